@@ -0,0 +1,441 @@
+/**
+ * @file lcz_lwm2m_ble_sensor.h
+ * @brief Process BLE advertisements for Laird Connectivity sensors,
+ * add LwM2M object instances, and update resource instances when values change.
+ *
+ * Copyright (c) 2022 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __LCZ_LWM2M_BLE_SENSOR_H__
+#define __LCZ_LWM2M_BLE_SENSOR_H__
+
+/**************************************************************************************************/
+/* Includes                                                                                       */
+/**************************************************************************************************/
+#include <zephyr.h>
+#include <bluetooth/addr.h>
+#include <net/buf.h>
+
+#include "lcz_sensor_adv_format.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************************************************************/
+/* Global Constants, Macros and Type Definitions                                                  */
+/**************************************************************************************************/
+enum lcz_lwm2m_ble_sensor_stat {
+	/* All advertisements received from the scan module */
+	LCZ_LWM2M_BLE_SENSOR_STAT_ADS = 0,
+	LCZ_LWM2M_BLE_SENSOR_STAT_LEGACY_ADS,
+	LCZ_LWM2M_BLE_SENSOR_STAT_RSP_ADS,
+	LCZ_LWM2M_BLE_SENSOR_STAT_CODED_ADS,
+	/* Events with a supported record type */
+	LCZ_LWM2M_BLE_SENSOR_STAT_ACCEPTED_ADS,
+	/* Events from a device in the gateway table */
+	LCZ_LWM2M_BLE_SENSOR_STAT_INDEXED_ADS,
+	/* Repeated events dropped by the per-device filter */
+	LCZ_LWM2M_BLE_SENSOR_STAT_DUPLICATE_ADS,
+	LCZ_LWM2M_BLE_SENSOR_STAT_PROCESSED_ADS,
+	LCZ_LWM2M_BLE_SENSOR_STAT_SET_EVENTS,
+	LCZ_LWM2M_BLE_SENSOR_STAT_SET_ERRORS,
+	LCZ_LWM2M_BLE_SENSOR_STAT_NAME_UPDATES,
+	/* Device wasn't in the local address index */
+	LCZ_LWM2M_BLE_SENSOR_STAT_INDEX_MISSES,
+	/* Device wasn't in the gateway table */
+	LCZ_LWM2M_BLE_SENSOR_STAT_LOOKUP_MISSES,
+	/* Gateway objects created */
+	LCZ_LWM2M_BLE_SENSOR_STAT_CREATES,
+	LCZ_LWM2M_BLE_SENSOR_STAT_CREATE_ENOMEM,
+	LCZ_LWM2M_BLE_SENSOR_STAT_CREATE_EPERM,
+	LCZ_LWM2M_BLE_SENSOR_STAT_CREATE_OTHER,
+	/* Create queue was full */
+	LCZ_LWM2M_BLE_SENSOR_STAT_CREATE_DROPS,
+	LCZ_LWM2M_BLE_SENSOR_STAT_QUEUE_DROPS,
+	LCZ_LWM2M_BLE_SENSOR_STAT_BATCH_MERGES,
+	LCZ_LWM2M_BLE_SENSOR_STAT_DEDUP_LOOKUPS,
+	LCZ_LWM2M_BLE_SENSOR_STAT_DEDUP_HITS,
+	LCZ_LWM2M_BLE_SENSOR_STAT_DEADBAND_DROPS,
+	/* Events processed ahead of routine events */
+	LCZ_LWM2M_BLE_SENSOR_STAT_PRIORITY_ADS,
+	/* A sample ring couldn't be allocated */
+	LCZ_LWM2M_BLE_SENSOR_STAT_SAMPLE_DROPS,
+	/* A device wasn't added because its ad was weaker than the minimum RSSI */
+	LCZ_LWM2M_BLE_SENSOR_STAT_WEAK_ADS,
+	/* A device was removed to make room for another device */
+	LCZ_LWM2M_BLE_SENSOR_STAT_EVICTIONS,
+	/* An ad was dropped because its device was recently rejected */
+	LCZ_LWM2M_BLE_SENSOR_STAT_REJECT_HITS,
+	/* Scanning was started for the expected ads of the devices */
+	LCZ_LWM2M_BLE_SENSOR_STAT_SCAN_WINDOWS,
+	/* Without deadband, a value equal to the last value of its resource wasn't written */
+	LCZ_LWM2M_BLE_SENSOR_STAT_UNCHANGED_DROPS,
+	LCZ_LWM2M_BLE_SENSOR_STAT_COUNT
+};
+
+struct lcz_lwm2m_ble_sensor_stats {
+	/* Uptime (ms) when the snapshot was taken */
+	int64_t timestamp;
+	/* Time (ms) since the previous snapshot */
+	uint32_t interval;
+	uint32_t count[LCZ_LWM2M_BLE_SENSOR_STAT_COUNT];
+	/* Increase per second since the previous snapshot */
+	uint32_t rate[LCZ_LWM2M_BLE_SENSOR_STAT_COUNT];
+};
+
+enum lcz_lwm2m_ble_sensor_stage {
+	/* All processing of an advertisement in the BT RX thread */
+	LCZ_LWM2M_BLE_SENSOR_STAGE_HANDLER = 0,
+	/* Search for manufacturer specific data */
+	LCZ_LWM2M_BLE_SENSOR_STAGE_FIND,
+	/* Match of the advertisement format */
+	LCZ_LWM2M_BLE_SENSOR_STAGE_MATCH,
+	/* Gateway index lookup (and create) */
+	LCZ_LWM2M_BLE_SENSOR_STAGE_INDEX,
+	/* Decode and write (or batch) of LwM2M resource updates */
+	LCZ_LWM2M_BLE_SENSOR_STAGE_PROCESS,
+	/* Refresh of the gateway object lifetime */
+	LCZ_LWM2M_BLE_SENSOR_STAGE_LIFETIME,
+	/* Write of batched LwM2M resource updates */
+	LCZ_LWM2M_BLE_SENSOR_STAGE_FLUSH,
+	LCZ_LWM2M_BLE_SENSOR_STAGE_COUNT
+};
+
+#define LCZ_LWM2M_BLE_SENSOR_TIMING_BUCKETS 24
+
+/* Durations are in hardware cycles (k_cycle_get_32) */
+struct lcz_lwm2m_ble_sensor_timing {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+	/* Bucket n counts durations of [2^n, 2^(n+1)) cycles.
+	 * The first bucket includes 0 and the last bucket includes all longer durations.
+	 */
+	uint32_t histogram[LCZ_LWM2M_BLE_SENSOR_TIMING_BUCKETS];
+};
+
+/* Battery voltage to percentage lookup table of a product.
+ * Entry n is the percentage at (min_mv + n * step_mv).
+ * Voltages outside of the table use the first or last entry.
+ */
+struct lcz_lwm2m_ble_sensor_battery_curve {
+	sys_snode_t node;
+	int product_id;
+	uint16_t min_mv;
+	uint16_t step_mv;
+	uint16_t count;
+	const uint8_t *level;
+};
+
+/* Reception of a device's ads.
+ * Ads dropped by the de-duplication cache are only counted when
+ * CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE is enabled.
+ */
+struct lcz_lwm2m_ble_sensor_signal {
+	/* Moving average (dBm) */
+	int8_t rssi;
+	int8_t rssi_last;
+	/* Moving average of the time between ads (ms); 0 until the second ad */
+	uint32_t interval;
+	uint32_t ads_per_minute;
+	uint32_t count;
+	/* Seconds since the last ad */
+	uint32_t age;
+};
+
+/* A reading of a resource instance */
+struct lcz_lwm2m_ble_sensor_sample {
+	/* Uptime (seconds) when the reading was processed */
+	uint32_t timestamp;
+	/* Thousandths of the LwM2M unit (battery is in mV) */
+	int32_t value;
+};
+
+/* A capture is a sequence of records.
+ * Each record is followed by len bytes of advertisement data.
+ */
+struct lcz_lwm2m_ble_sensor_capture_record {
+	/* Uptime (ms) when the advertisement was received */
+	uint32_t timestamp;
+	bt_addr_le_t addr;
+	int8_t rssi;
+	uint8_t type;
+	uint16_t len;
+} __packed;
+
+/* Values are fixed point until they are written (battery is in mV) */
+#define LCZ_LWM2M_BLE_SENSOR_FIXED_SCALE 1000
+
+/* LwM2M object updated by a decoder.
+ * Decoders of objects that the module doesn't support use LCZ_LWM2M_BLE_SENSOR_OBJ_CUSTOM + n,
+ * where n is less than CONFIG_LCZ_LWM2M_BLE_SENSOR_DECODER_CHANNELS.
+ */
+enum lcz_lwm2m_ble_sensor_obj {
+	LCZ_LWM2M_BLE_SENSOR_OBJ_TEMPERATURE = 0,
+	LCZ_LWM2M_BLE_SENSOR_OBJ_CURRENT,
+	LCZ_LWM2M_BLE_SENSOR_OBJ_PRESSURE,
+	LCZ_LWM2M_BLE_SENSOR_OBJ_BATTERY,
+	LCZ_LWM2M_BLE_SENSOR_OBJ_FILL_LEVEL,
+	LCZ_LWM2M_BLE_SENSOR_OBJ_CUSTOM
+};
+
+/* Returns the fixed point value of an event; scale is the multiplier from the reported unit */
+typedef int32_t (*lcz_lwm2m_ble_sensor_decode_t)(int idx, const LczSensorAdEvent_t *p,
+						  int32_t scale);
+
+/* Writes a fixed point value to a resource instance of a device's object */
+typedef int (*lcz_lwm2m_ble_sensor_set_t)(int idx, uint16_t offset, int32_t value);
+
+/* Describes how the events of a sensor are converted and which LwM2M object they update.
+ * When several decoders handle a record type, a decoder that lists the device's product
+ * is used before one that handles all products. They must update the same resource instance.
+ */
+struct lcz_lwm2m_ble_sensor_decoder {
+	const uint8_t *record_types;
+	uint8_t record_count;
+	/* Resource instance of each record type; NULL when it is the position in record_types */
+	const uint8_t *offsets;
+	/* NULL for all products */
+	const uint16_t *product_ids;
+	uint8_t product_count;
+	uint8_t obj;
+	int32_t scale;
+	lcz_lwm2m_ble_sensor_decode_t decode;
+	lcz_lwm2m_ble_sensor_set_t set;
+};
+
+#define LCZ_LWM2M_BLE_SENSOR_DECODER_TYPES(_types)                                                 \
+	.record_types = (_types), .record_count = ARRAY_SIZE(_types)
+
+#define LCZ_LWM2M_BLE_SENSOR_DECODER_PRODUCTS(_products)                                           \
+	.product_ids = (_products), .product_count = ARRAY_SIZE(_products)
+
+/**
+ * @brief Register a decoder.
+ * The record type lookup table is built from the registered decoders when the module
+ * is initialized.
+ *
+ * @param _name name of the decoder
+ * @param ... designated initializers of the struct lcz_lwm2m_ble_sensor_decoder fields
+ */
+#define LCZ_LWM2M_BLE_SENSOR_DECODER_DEFINE(_name, ...)                                            \
+	static const STRUCT_SECTION_ITERABLE(lcz_lwm2m_ble_sensor_decoder, _name) = { __VA_ARGS__ }
+
+/**************************************************************************************************/
+/* Global Function Prototypes                                                                     */
+/**************************************************************************************************/
+/**
+ * @brief Take a snapshot of the statistics.
+ * Requires CONFIG_LCZ_LWM2M_BLE_SENSOR_STATS.
+ *
+ * @note Rates are relative to the previous snapshot taken by any caller.
+ *
+ * @param stats destination
+ * @return int 0 on success, else negative errno
+ */
+int lcz_lwm2m_ble_sensor_stats_snapshot(struct lcz_lwm2m_ble_sensor_stats *stats);
+
+/**
+ * @brief Clear all statistics
+ */
+void lcz_lwm2m_ble_sensor_stats_reset(void);
+
+/**
+ * @param stat statistic
+ * @return const char* name of statistic
+ */
+const char *lcz_lwm2m_ble_sensor_stat_name(enum lcz_lwm2m_ble_sensor_stat stat);
+
+/**
+ * @brief Read the timing of a processing stage.
+ * Requires CONFIG_LCZ_LWM2M_BLE_SENSOR_TIMING.
+ *
+ * @param stage processing stage
+ * @param timing destination
+ * @return int 0 on success, else negative errno
+ */
+int lcz_lwm2m_ble_sensor_timing_get(enum lcz_lwm2m_ble_sensor_stage stage,
+				    struct lcz_lwm2m_ble_sensor_timing *timing);
+
+/**
+ * @brief Clear the timing of all processing stages
+ */
+void lcz_lwm2m_ble_sensor_timing_reset(void);
+
+/**
+ * @param stage processing stage
+ * @return const char* name of stage
+ */
+const char *lcz_lwm2m_ble_sensor_stage_name(enum lcz_lwm2m_ble_sensor_stage stage);
+
+/**
+ * @brief Register the battery curve of a product.
+ * Requires CONFIG_LCZ_LWM2M_BATTERY.
+ *
+ * @note The curve must remain valid after registration.
+ * A registered curve takes precedence over the built-in curve of the same product.
+ *
+ * @param curve battery curve
+ * @return int 0 on success, else negative errno
+ */
+int lcz_lwm2m_ble_sensor_battery_register(struct lcz_lwm2m_ble_sensor_battery_curve *curve);
+
+/**
+ * @brief Process an advertisement as if it had been received by the scanner.
+ * Requires CONFIG_LCZ_LWM2M_BLE_SENSOR_BENCHMARK.
+ *
+ * @param addr advertiser address
+ * @param rssi received signal strength
+ * @param type advertisement type
+ * @param ad advertisement data
+ */
+void lcz_lwm2m_ble_sensor_ad_inject(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+				    struct net_buf_simple *ad);
+
+/**
+ * @brief Forget every known device so that each benchmark run starts from the same state.
+ * Requires CONFIG_LCZ_LWM2M_BLE_SENSOR_BENCHMARK.
+ *
+ * @note The caller must also empty its stand-in for the gateway object table.
+ */
+void lcz_lwm2m_ble_sensor_bench_reset(void);
+
+/**
+ * @brief Forget the devices that were rejected by the gateway object.
+ * Requires CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE.
+ *
+ * @note Call this after the gateway's allow or block list is changed.
+ */
+void lcz_lwm2m_ble_sensor_reject_cache_clear(void);
+
+/**
+ * @brief Set the minimum RSSI of an ad that adds a device to the gateway object table.
+ * Devices that are already in the table are processed regardless of RSSI.
+ *
+ * @param rssi dBm; -127 adds devices regardless of RSSI
+ */
+void lcz_lwm2m_ble_sensor_create_min_rssi_set(int8_t rssi);
+
+/**
+ * @return int8_t the minimum RSSI of an ad that adds a device to the gateway object table
+ */
+int8_t lcz_lwm2m_ble_sensor_create_min_rssi_get(void);
+
+/**
+ * @brief Get the reception of a device's ads.
+ * Requires CONFIG_LCZ_LWM2M_BLE_SENSOR_SIGNAL.
+ *
+ * @param idx gateway object index
+ * @param signal destination
+ * @return int 0 on success, -ENOENT if no ads have been received, else negative errno
+ */
+int lcz_lwm2m_ble_sensor_signal_get(int idx, struct lcz_lwm2m_ble_sensor_signal *signal);
+
+/**
+ * @brief Take the buffered readings of a resource instance, oldest first.
+ * Requires CONFIG_LCZ_LWM2M_BLE_SENSOR_SAMPLES.
+ *
+ * @note The resource instance is the one updated by the record type,
+ * so record types that update the same instance share their samples.
+ *
+ * @param idx gateway object index
+ * @param record_type sensor event type
+ * @param samples destination
+ * @param max maximum number of samples to take
+ * @return int number of samples taken, else negative errno
+ */
+int lcz_lwm2m_ble_sensor_samples_take(int idx, uint8_t record_type,
+				      struct lcz_lwm2m_ble_sensor_sample *samples, size_t max);
+
+/**
+ * @param idx gateway object index
+ * @param record_type sensor event type
+ * @return int number of buffered samples, else negative errno
+ */
+int lcz_lwm2m_ble_sensor_samples_count(int idx, uint8_t record_type);
+
+/**
+ * @brief Set the priority of a record type.
+ * Requires CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY.
+ *
+ * @note Priority events bypass deadband and batching. With deferred processing,
+ * they have their own queue that is serviced before the queue of routine events.
+ *
+ * @param record_type sensor event type
+ * @param priority true for a priority event, false for a routine event
+ * @return int 0 on success, else negative errno
+ */
+int lcz_lwm2m_ble_sensor_priority_set(uint8_t record_type, bool priority);
+
+/**
+ * @param record_type sensor event type
+ * @return bool true if the record type is a priority event
+ */
+bool lcz_lwm2m_ble_sensor_priority_get(uint8_t record_type);
+
+/**
+ * @brief Start appending received advertisements to the capture.
+ * Requires CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE.
+ *
+ * @note When the capture is full, the oldest records are overwritten.
+ */
+void lcz_lwm2m_ble_sensor_capture_start(void);
+
+/**
+ * @brief Stop capturing advertisements
+ */
+void lcz_lwm2m_ble_sensor_capture_stop(void);
+
+/**
+ * @brief Discard all capture records
+ */
+void lcz_lwm2m_ble_sensor_capture_clear(void);
+
+/**
+ * @return size_t size of the capture in bytes
+ */
+size_t lcz_lwm2m_ble_sensor_capture_size(void);
+
+/**
+ * @brief Copy part of the capture (for example, to offload it).
+ *
+ * @note Stop the capture first so that offsets don't move between reads.
+ *
+ * @param offset offset from the start of the oldest record
+ * @param buf destination
+ * @param size size of destination
+ * @return size_t number of bytes copied
+ */
+size_t lcz_lwm2m_ble_sensor_capture_read(size_t offset, uint8_t *buf, size_t size);
+
+/**
+ * @brief Process a capture as if it was received by the scanner.
+ * Advertisements from the scanner are dropped until the replay ends.
+ * Requires CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE.
+ *
+ * @param data capture records (as read with lcz_lwm2m_ble_sensor_capture_read)
+ * @param len length of data
+ * @param speed 0 for no delay between records, 1 for the original rate,
+ * n for n times the original rate
+ * @return int number of records processed, else negative errno
+ */
+int lcz_lwm2m_ble_sensor_replay(const uint8_t *data, size_t len, uint32_t speed);
+
+/**
+ * @brief Process the records of the (stopped) capture.
+ * Requires CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE.
+ *
+ * @param speed see lcz_lwm2m_ble_sensor_replay
+ * @return int number of records processed, else negative errno
+ */
+int lcz_lwm2m_ble_sensor_capture_replay(uint32_t speed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LCZ_LWM2M_BLE_SENSOR_H__ */
@@ -26,6 +26,7 @@ LOG_MODULE_REGISTER(lwm2m_ble_sensor, CONFIG_LCZ_LWM2M_BLE_SENSOR_LOG_LEVEL);
 #include "lcz_sensor_event.h"
 #include "lcz_sensor_adv_format.h"
 #include "lcz_sensor_adv_match.h"
+#include "lcz_lwm2m_ble_sensor.h"
 
 #if defined(CONFIG_LCZ_LWM2M_TEMPERATURE)
 #include "lcz_lwm2m_temperature.h"
@@ -48,6 +49,14 @@ LOG_MODULE_REGISTER(lwm2m_ble_sensor, CONFIG_LCZ_LWM2M_BLE_SENSOR_LOG_LEVEL);
 #include "lcz_lwm2m_fill_level.h"
 #endif
 
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ACCEPT_LIST)
+#include <bluetooth/bluetooth.h>
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+#include <settings/settings.h>
+#endif
+
 #if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_LED)
 #include "lcz_led.h"
 #include "led_config.h"
@@ -57,29 +66,259 @@ LOG_MODULE_REGISTER(lwm2m_ble_sensor, CONFIG_LCZ_LWM2M_BLE_SENSOR_LOG_LEVEL);
 /* Local Constant, Macro and Type Definitions                                                     */
 /**************************************************************************************************/
 #define LIFETIME CONFIG_LCZ_LWM2M_BLE_EVENT_TIMEOUT_SECONDS
+/* Seconds after which the gateway object's lifetime is refreshed */
+#define LIFETIME_REFRESH ((LIFETIME * CONFIG_LCZ_LWM2M_BLE_SENSOR_LIFETIME_REFRESH_PERCENT) / 100)
 #define MAX_INSTANCES CONFIG_LCZ_LWM2M_GATEWAY_MAX_INSTANCES
 
-struct lwm2m_ble_sensor {
-	uint8_t last_record_type;
-	uint16_t last_event_id;
-	int product_id;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_INGEST_COUNT)
+#define INGEST_COUNT CONFIG_LCZ_LWM2M_BLE_SENSOR_INGEST_COUNT
+#else
+#define INGEST_COUNT 1
+#endif
+/* An evicted device is removed by the gateway object when this lifetime (seconds) expires */
+#define EVICT_LIFETIME 1
+/* Returned by get_index() for a device in the reject cache */
+#define INDEX_REJECTED -EACCES
+
+/* The address index is an open-addressed (linear probing) hash table.
+ * It is never more than half full.
+ */
+#define ADDR_INDEX_SIZE (2 * MAX_INSTANCES)
+#define ADDR_INDEX_EMPTY -1
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEDUP_CACHE)
+#define DEDUP_CACHE_SIZE CONFIG_LCZ_LWM2M_BLE_SENSOR_DEDUP_CACHE_SIZE
+BUILD_ASSERT(IS_POWER_OF_TWO(DEDUP_CACHE_SIZE), "Cache size must be a power of two");
+
+/* Direct-mapped cache of recently seen events */
+struct dedup_entry {
+	uint32_t addr_hash;
+	uint16_t event_id;
+	/* Entries are flushed when a device is removed, so the index can't be reused */
+	uint16_t idx;
+	uint8_t record_type;
+	bool valid;
+};
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE)
+#define REJECT_CACHE_SIZE CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE_SIZE
+BUILD_ASSERT(IS_POWER_OF_TWO(REJECT_CACHE_SIZE), "Cache size must be a power of two");
+
+/* Direct-mapped cache of devices that couldn't be added */
+struct reject_entry {
+	uint32_t addr_hash;
+	/* Uptime (seconds); 0 when the entry is unused */
+	uint32_t expires;
+};
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE)
+#define CAPTURE_SIZE CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE_SIZE
+#define CAPTURE_HEADER_SIZE sizeof(struct lcz_lwm2m_ble_sensor_capture_record)
+/* Longer (extended) advertisements aren't captured */
+#define CAPTURE_AD_MAX 255
+#define SCAN_HANDLER capture_handler
+#else
+#define SCAN_HANDLER ad_handler
+#endif
+
+/* The record type and id of an event packed into one word.
+ * Record type 0 is reserved, so a key of 0 never matches an event.
+ */
+#define EVENT_KEY(_record_type, _id) (((uint32_t)(_record_type) << 16) | (uint16_t)(_id))
+#define EVENT_KEY_NONE 0
+
+enum ad_format {
+	AD_FORMAT_NONE,
+	AD_FORMAT_1M,
+	AD_FORMAT_CODED,
+	AD_FORMAT_RSP,
+};
+
+/* The parts of an advertisement found in one pass over its AD structures */
+struct ad_desc {
+	enum ad_format format;
+	AdHandle_t mfg;
+	AdHandle_t name;
+};
+
+#define DECODER_CHANNELS CONFIG_LCZ_LWM2M_BLE_SENSOR_DECODER_CHANNELS
+
+/* Each custom object has at least one channel */
+enum obj_type {
+	OBJ_TEMPERATURE = LCZ_LWM2M_BLE_SENSOR_OBJ_TEMPERATURE,
+	OBJ_CURRENT = LCZ_LWM2M_BLE_SENSOR_OBJ_CURRENT,
+	OBJ_PRESSURE = LCZ_LWM2M_BLE_SENSOR_OBJ_PRESSURE,
+	OBJ_BATTERY = LCZ_LWM2M_BLE_SENSOR_OBJ_BATTERY,
+	OBJ_FILL_LEVEL = LCZ_LWM2M_BLE_SENSOR_OBJ_FILL_LEVEL,
+	OBJ_CUSTOM = LCZ_LWM2M_BLE_SENSOR_OBJ_CUSTOM,
+	OBJ_COUNT = OBJ_CUSTOM + DECODER_CHANNELS
+};
+BUILD_ASSERT(OBJ_COUNT <= UINT8_MAX, "Object type must fit in a byte");
+
+/* Each resource instance that can be updated by a sensor has a channel */
+enum channel {
+#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE)
+	CHANNEL_TEMPERATURE,
+	CHANNEL_TEMPERATURE_LAST = CHANNEL_TEMPERATURE + 3,
+#endif
+#if defined(CONFIG_LCZ_LWM2M_CURRENT)
+	CHANNEL_CURRENT,
+	CHANNEL_CURRENT_LAST = CHANNEL_CURRENT + 3,
+#endif
+#if defined(CONFIG_LCZ_LWM2M_PRESSURE)
+	CHANNEL_PRESSURE,
+	CHANNEL_PRESSURE_LAST = CHANNEL_PRESSURE + 1,
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BATTERY)
+	CHANNEL_BATTERY,
+	CHANNEL_BATTERY_LAST = CHANNEL_BATTERY,
+#endif
+#if defined(CONFIG_LCZ_LWM2M_FILL_LEVEL)
+	CHANNEL_FILL_LEVEL,
+	CHANNEL_FILL_LEVEL_LAST = CHANNEL_FILL_LEVEL,
+#endif
+	/* Assigned to the custom objects of registered decoders */
+	CHANNEL_CUSTOM,
+	CHANNEL_COUNT = CHANNEL_CUSTOM + DECODER_CHANNELS
+};
+BUILD_ASSERT(CHANNEL_COUNT <= 32, "Channel valid flags must fit in a word");
+
+/* Values are fixed point (thousandths of the LwM2M unit) until they are written */
+#define FIXED_SCALE LCZ_LWM2M_BLE_SENSOR_FIXED_SCALE
+
+/* New value for a resource of an LwM2M object */
+struct obj_update {
+	int16_t idx;
+	uint8_t obj;
+	uint16_t offset;
+	uint8_t channel;
+	int32_t value;
+	lcz_lwm2m_ble_sensor_set_t set;
+};
+
+/* Channels of the resource instances of an object */
+struct obj_channels {
+	uint8_t base;
+	uint8_t count;
+};
+
+#if defined(CONFIG_LCZ_LWM2M_BATTERY)
+#define BATTERY_LUT_MIN_MV CONFIG_LCZ_LWM2M_BLE_SENSOR_BATTERY_LUT_MIN_MV
+#define BATTERY_LUT_STEP_MV CONFIG_LCZ_LWM2M_BLE_SENSOR_BATTERY_LUT_STEP_MV
+#define BATTERY_LUT_SIZE                                                                           \
+	(((CONFIG_LCZ_LWM2M_BLE_SENSOR_BATTERY_LUT_MAX_MV - BATTERY_LUT_MIN_MV) /                  \
+	  BATTERY_LUT_STEP_MV) +                                                                   \
+	 1)
+BUILD_ASSERT(CONFIG_LCZ_LWM2M_BLE_SENSOR_BATTERY_LUT_MAX_MV > BATTERY_LUT_MIN_MV,
+	     "Invalid battery voltage range");
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEADBAND)
+struct deadband_config {
+	/* Minimum change from the last reported value */
+	uint32_t delta;
+	/* Seconds; a changed value isn't reported until this has elapsed */
+	uint32_t min_interval;
+	/* Seconds; the value is reported when this has elapsed, even if it hasn't changed.
+	 * 0 disables the refresh.
+	 */
+	uint32_t max_silence;
+};
+
+/* Last reported value of a channel */
+struct deadband_state {
+	int32_t value;
+	uint32_t time;
+	bool valid;
+};
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH)
+struct batch_entry {
+	struct obj_update u;
+	uint32_t gen;
+};
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_QUEUE)
+#define CREATE_QUEUE_SIZE CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_QUEUE_SIZE
+
+/* Device waiting for a gateway object and the event that triggered it */
+struct create_request {
+	bt_addr_le_t addr;
+	LczSensorAdEvent_t ad;
+	int8_t rssi;
+};
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+#define PERSIST_SUBTREE "lwm2m_ble_sensor"
+#define PERSIST_KEY "devices"
+
+/* Saved state of a device; gateway indices can change after a reset */
+struct persist_record {
+	bt_addr_le_t addr;
+	uint16_t product_id;
+	uint32_t last_event;
+} __packed;
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SAMPLES)
+#define SAMPLE_RING_SIZE CONFIG_LCZ_LWM2M_BLE_SENSOR_SAMPLE_RING_SIZE
+#define SAMPLE_RINGS (MAX_INSTANCES * CONFIG_LCZ_LWM2M_BLE_SENSOR_SAMPLE_RINGS_PER_DEVICE)
+
+/* Samples of one channel of a device; allocated from a pool when the channel first reports */
+struct sample_ring {
+	sys_snode_t node;
+	uint8_t channel;
+	uint8_t head;
+	uint8_t count;
+	struct lcz_lwm2m_ble_sensor_sample samples[SAMPLE_RING_SIZE];
+};
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEFERRED)
+/* Record queued by the BT RX thread for the processing work queue */
+struct ad_event {
+	LczSensorAdEvent_t ad;
+	int16_t idx;
+	uint32_t gen;
+	int8_t rssi;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+	/* Order in which events were queued */
+	uint32_t seq;
+#endif
 };
+#endif
 
-struct stats {
-	uint32_t ads;
-	uint32_t legacy_ads;
-	uint32_t rsp_ads;
-	uint32_t coded_ads;
-	uint32_t accepted_ads;
-	uint32_t indexed_ads;
-	uint32_t processed_ads;
-	uint32_t set_events;
-	uint32_t set_errors;
-	uint32_t name_updates;
+/* Ads are divided between ingest instances by address hash, so the events of a device are
+ * always queued and processed in order by the same instance.
+ */
+struct ingest {
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEFERRED)
+	struct k_msgq msgq;
+	struct k_work_q workq;
+	struct k_work work;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH)
+	struct batch_entry batch[CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH_SIZE];
+	size_t batch_count;
+	struct k_work_delayable batch_work;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+	struct k_msgq priority_msgq;
+	atomic_t seq;
+	/* Channels with a priority event that was processed ahead of queued routine events;
+	 * only accessed from the instance's work queue.
+	 */
+	uint32_t priority_valid[MAX_INSTANCES];
+#endif
+#endif
 };
 
 #if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_STATS)
-#define INCR_STAT(field) lbs.stats.field += 1
+#define INCR_STAT(field) atomic_inc(&lbs.stats[LCZ_LWM2M_BLE_SENSOR_STAT_##field])
 #else
 #define INCR_STAT(field)
 #endif
@@ -88,419 +327,3424 @@ static struct bt_le_scan_param scan_parameters = BT_LE_SCAN_PARAM_INIT(
 	BT_LE_SCAN_TYPE_ACTIVE, (BT_LE_SCAN_OPT_CODED | BT_LE_SCAN_OPT_FILTER_DUPLICATE),
 	CONFIG_LCZ_BT_SCAN_DEFAULT_INTERVAL, CONFIG_LCZ_BT_SCAN_DEFAULT_WINDOW);
 
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ADAPTIVE_SCAN)
+BUILD_ASSERT(CONFIG_LCZ_LWM2M_BLE_SENSOR_DISCOVERY_SCAN_WINDOW <=
+		     CONFIG_LCZ_LWM2M_BLE_SENSOR_DISCOVERY_SCAN_INTERVAL,
+	     "Scan window can't be larger than the interval");
+BUILD_ASSERT(CONFIG_LCZ_LWM2M_BLE_SENSOR_STEADY_SCAN_WINDOW <=
+		     CONFIG_LCZ_LWM2M_BLE_SENSOR_STEADY_SCAN_INTERVAL,
+	     "Scan window can't be larger than the interval");
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE)
+#define SCAN_GUARD_MS CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE_GUARD_MS
+/* Windows around a shorter period would overlap or leave scanning off too briefly to matter */
+#define SCAN_MIN_PERIOD_MS (4 * SCAN_GUARD_MS)
+#endif
+
 /**************************************************************************************************/
 /* Local Data Definitions                                                                         */
 /**************************************************************************************************/
 
 static struct {
 	int scan_user_id;
-	bool table_full;
+	struct ingest ingest[INGEST_COUNT];
+	/* Set by create and cleared by removal; read by the BT RX thread */
+	atomic_t table_full;
+	/* Devices that aren't in the table are ignored until an ad is at least this strong */
+	int8_t create_min_rssi;
 	struct lwm2m_obj_agent agent;
-	struct lwm2m_ble_sensor table[MAX_INSTANCES];
+	/* The per-device table is split into arrays so that the duplicate check,
+	 * done for every accepted ad, only touches one word per device.
+	 * The sequence counter of each device is odd while its event fields are written.
+	 * It is also the writer lock, so writers of different devices don't share a lock,
+	 * and a reader can check for a repeat without writing.
+	 */
+	atomic_t event_seq[MAX_INSTANCES];
+	uint32_t last_event[MAX_INSTANCES];
+	/* Id of the last event of each channel; a sensor can interleave ads of several channels */
+	uint32_t channel_valid[MAX_INSTANCES];
+	uint16_t channel_event[MAX_INSTANCES][CHANNEL_COUNT];
+	uint16_t product_id[MAX_INSTANCES];
+	/* Built from the registered decoders at init; indexed by record type.
+	 * A record type is shared when more than one decoder handles it.
+	 */
+	const struct lcz_lwm2m_ble_sensor_decoder *decoder[UINT8_MAX + 1];
+	uint8_t decoder_offset[UINT8_MAX + 1];
+	ATOMIC_DEFINE(decoder_shared, UINT8_MAX + 1);
+	/* The name search is skipped while a device's name is settled */
+	ATOMIC_DEFINE(name_settled, MAX_INSTANCES);
+	ATOMIC_DEFINE(name_hashed, MAX_INSTANCES);
+	uint32_t name_hash[MAX_INSTANCES];
+	struct k_work_delayable name_work;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SIGNAL)
+	/* Moving averages of RSSI (1/16 dBm) and of the time between ads (ms).
+	 * Written by the BT RX thread and cleared when a device is removed.
+	 */
+	struct k_spinlock signal_lock;
+	int16_t rssi_avg[MAX_INSTANCES];
+	int8_t rssi_last[MAX_INSTANCES];
+	uint32_t ad_interval[MAX_INSTANCES];
+	uint32_t ad_last[MAX_INSTANCES];
+	uint32_t ad_count[MAX_INSTANCES];
+#endif
+	/* Uptime (seconds) when the gateway object's lifetime was last set */
+	uint32_t lifetime_refreshed[MAX_INSTANCES];
+	bool lifetime_valid[MAX_INSTANCES];
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ADAPTIVE_SCAN) || defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT)
+	/* Uptime (seconds) of the last ad from the device */
+	uint32_t last_seen[MAX_INSTANCES];
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT)
+	/* Ads of a device that is being removed are ignored so that its lifetime isn't refreshed */
+	ATOMIC_DEFINE(evicting, MAX_INSTANCES);
+	/* One more than the uptime (seconds) of the last search for a device to remove;
+	 * zero until the first search.
+	 */
+	atomic_t evict_time;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BATTERY)
+	/* Curves registered by the application are in front of the built-in curves */
+	struct k_spinlock battery_lock;
+	sys_slist_t battery_curves;
+	uint8_t bt510_level[BATTERY_LUT_SIZE];
+	uint8_t bt610_level[BATTERY_LUT_SIZE];
+	struct lcz_lwm2m_ble_sensor_battery_curve bt510_curve;
+	struct lcz_lwm2m_ble_sensor_battery_curve bt610_curve;
+#endif
+	/* Local copy of the gateway object's address to index mapping */
+	struct k_spinlock addr_index_lock;
+	int16_t addr_index[ADDR_INDEX_SIZE];
+	bt_addr_le_t addr[MAX_INSTANCES];
+	bool addr_indexed[MAX_INSTANCES];
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEDUP_CACHE)
+	/* Entries are invalidated by the work queue when a queued event is dropped */
+	struct k_spinlock dedup_lock;
+	struct dedup_entry dedup[DEDUP_CACHE_SIZE];
+	atomic_t dedup_flush;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE)
+	/* Accessed from the BT RX thread and, with the create queue, the work queue */
+	struct k_spinlock reject_lock;
+	struct reject_entry reject[REJECT_CACHE_SIZE];
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEFERRED)
+	/* Incremented when a gateway index is freed so that stale queued events are dropped.
+	 * It is wide enough not to wrap while an event is queued.
+	 */
+	uint32_t gen[MAX_INSTANCES];
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+	/* Record types that bypass deadband and batching (and have their own queue) */
+	ATOMIC_DEFINE(priority, 256);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEFERRED)
+	/* Only accessed from the work queue of the device's ingest instance */
+	uint32_t priority_seq[MAX_INSTANCES][CHANNEL_COUNT];
+#endif
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_QUEUE)
+	/* FIFO of devices to create */
+	struct k_spinlock create_lock;
+	struct create_request create[CREATE_QUEUE_SIZE];
+	size_t create_head;
+	size_t create_count;
+	/* Uptime of the last create attempt paces creates across bursts */
+	int64_t create_time;
+	struct k_work_delayable create_work;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEADBAND)
+	struct deadband_state deadband[MAX_INSTANCES][CHANNEL_COUNT];
+#else
+	/* Last value of each channel that was passed on to be written */
+	uint32_t value_valid[MAX_INSTANCES];
+	int32_t last_value[MAX_INSTANCES][CHANNEL_COUNT];
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_TIMING)
+	struct k_spinlock timing_lock;
+	struct lcz_lwm2m_ble_sensor_timing timing[LCZ_LWM2M_BLE_SENSOR_STAGE_COUNT];
+#endif
 #if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_STATS)
-	struct stats stats;
+	atomic_t stats[LCZ_LWM2M_BLE_SENSOR_STAT_COUNT];
+	struct k_spinlock stats_lock;
+	int64_t stats_timestamp;
+	uint32_t stats_prev[LCZ_LWM2M_BLE_SENSOR_STAT_COUNT];
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ADAPTIVE_SCAN)
+	/* Only accessed from the system work queue after init */
+	struct k_work_delayable scan_work;
+	bool scan_steady;
+	uint8_t scan_quiet_periods;
+	uint32_t scan_creates;
+	uint32_t scan_accepted;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE)
+	/* Scanning is only on around the expected ads of the devices */
+	struct k_work_delayable scan_window_work;
+	bool scan_scheduled;
+	bool scan_window;
+	/* Uptime (seconds) of the last evaluation period that scanned continuously */
+	uint32_t scan_continuous;
+#endif
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+	/* Records loaded from settings that haven't been matched to a gateway index */
+	struct k_spinlock persist_lock;
+	struct persist_record restore[MAX_INSTANCES];
+	size_t restore_count;
+	bool restore_loaded;
+	atomic_t persist_dirty;
+	struct k_work_delayable persist_work;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ACCEPT_LIST)
+	/* Only accessed from the system work queue */
+	struct k_work accept_list_work;
+	bool accept_list_active;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE)
+	/* Byte ring of capture records; the oldest records are overwritten */
+	struct k_spinlock capture_lock;
+	uint8_t capture[CAPTURE_SIZE];
+	size_t capture_head;
+	size_t capture_used;
+	atomic_t capture_active;
+	/* A replay owns the processing; the BT RX thread drops live ads until it ends */
+	atomic_t replay_busy;
+	/* Number of live ads that the BT RX thread is processing */
+	atomic_t rx_active;
+	/* Given when the last live ad is done while a replay waits */
+	struct k_sem rx_idle;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SAMPLES)
+	struct k_spinlock sample_lock;
+	sys_slist_t sample_rings[MAX_INSTANCES];
 #endif
 } lbs;
 
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SAMPLES)
+K_MEM_SLAB_DEFINE_STATIC(lbs_sample_slab, sizeof(struct sample_ring), SAMPLE_RINGS, 4);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEFERRED)
+K_THREAD_STACK_ARRAY_DEFINE(lbs_workq_stack, INGEST_COUNT,
+			    CONFIG_LCZ_LWM2M_BLE_SENSOR_WORKQ_STACK_SIZE);
+static char __aligned(4) lbs_msgq_buffer[INGEST_COUNT][sizeof(struct ad_event) *
+						       CONFIG_LCZ_LWM2M_BLE_SENSOR_QUEUE_DEPTH];
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+static char __aligned(4)
+	lbs_priority_msgq_buffer[INGEST_COUNT][sizeof(struct ad_event) *
+					       CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY_QUEUE_DEPTH];
+#endif
+#endif
+
 /**************************************************************************************************/
 /* Local Function Prototypes                                                                      */
 /**************************************************************************************************/
 static int get_index(const bt_addr_le_t *addr, bool add);
+static int create_device(const bt_addr_le_t *addr);
 static bool valid_index(int idx);
 
-static void ad_handler(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
-		       struct net_buf_simple *ad);
-static bool ad_discard(LczSensorAdEvent_t *p);
-static int ad_filter(const bt_addr_le_t *addr, LczSensorAdEvent_t *p, int8_t rssi);
-static void ad_process(int idx, LczSensorAdEvent_t *p, int8_t rssi);
+static uint32_t addr_hash(const bt_addr_le_t *addr);
+static int addr_index_lookup(const bt_addr_le_t *addr);
+static void addr_index_add(const bt_addr_le_t *addr, int idx);
+static void addr_index_remove(int idx);
+static void addr_index_remove_locked(int idx);
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEDUP_CACHE)
+static int dedup_check(uint32_t hash, LczSensorAdEvent_t *p);
+static void dedup_add(uint32_t hash, LczSensorAdEvent_t *p, int idx);
+static void dedup_invalidate(const bt_addr_le_t *addr, uint8_t record_type);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE)
+static bool reject_check(const bt_addr_le_t *addr);
+static void reject_add(const bt_addr_le_t *addr);
+static void reject_clear(void);
+#endif
+
+static inline int ingest_index(const bt_addr_le_t *addr);
+static inline struct ingest *ingest_of(int idx);
+
+static void ad_handler(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+		       struct net_buf_simple *ad);
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE)
+static void capture_handler(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+			    struct net_buf_simple *ad);
+static void rx_done(void);
+static void capture_copy_in(size_t offset, const void *src, size_t len);
+static void capture_copy_out(size_t offset, void *dst, size_t len);
+static int replay_begin(void);
+static void replay_delay(uint32_t *prev, uint32_t timestamp, uint32_t speed);
+static void replay_record(const struct lcz_lwm2m_ble_sensor_capture_record *record,
+			  const uint8_t *data);
+#endif
+static bool ad_discard(const LczSensorAdEvent_t *p);
+static int ad_filter(const bt_addr_le_t *addr, LczSensorAdEvent_t *p, int8_t rssi);
+static void ad_process(int idx, LczSensorAdEvent_t *p, int8_t rssi);
+static void ad_update(int idx, LczSensorAdEvent_t *p, int8_t rssi);
+static bool ad_decode(int idx, const LczSensorAdEvent_t *p, struct obj_update *u);
+static inline int obj_set(const struct obj_update *u);
+
+static void decoder_init(void);
+static int decoder_offset(const struct lcz_lwm2m_ble_sensor_decoder *d, uint8_t record_type);
+static bool decoder_product(const struct lcz_lwm2m_ble_sensor_decoder *d, uint16_t product_id);
+static const struct lcz_lwm2m_ble_sensor_decoder *decoder_find(uint8_t record_type,
+							       uint16_t product_id);
+
+static inline uint8_t record_channel(uint8_t record_type);
+static unsigned int event_write_begin(int idx);
+static void event_write_end(int idx, unsigned int key);
+static bool event_read_begin(int idx, atomic_val_t *seq);
+static bool event_read_retry(int idx, atomic_val_t seq);
+static bool event_duplicate(int idx, const LczSensorAdEvent_t *p, uint32_t key);
+static void event_record(int idx, const LczSensorAdEvent_t *p, uint32_t key);
+static bool event_claim(int idx, const LczSensorAdEvent_t *p, uint32_t key);
+static bool event_forget(int idx, const LczSensorAdEvent_t *p);
+static inline bool event_priority(uint8_t record_type);
+
+#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE)
+static int32_t decode_s16(int idx, const LczSensorAdEvent_t *p, int32_t scale);
+#endif
+#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE) || defined(CONFIG_LCZ_LWM2M_CURRENT) ||                  \
+	defined(CONFIG_LCZ_LWM2M_PRESSURE) || defined(CONFIG_LCZ_LWM2M_FILL_LEVEL)
+static int32_t decode_float(int idx, const LczSensorAdEvent_t *p, int32_t scale);
+#endif
+
+static inline double fixed_to_double(int32_t value);
+
+#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE)
+static int set_temperature(int idx, uint16_t offset, int32_t value);
+#endif
+#if defined(CONFIG_LCZ_LWM2M_CURRENT)
+static int set_current(int idx, uint16_t offset, int32_t value);
+#endif
+#if defined(CONFIG_LCZ_LWM2M_PRESSURE)
+static int set_pressure(int idx, uint16_t offset, int32_t value);
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BATTERY)
+static int32_t decode_u16(int idx, const LczSensorAdEvent_t *p, int32_t scale);
+static int32_t decode_s32(int idx, const LczSensorAdEvent_t *p, int32_t scale);
+static int set_battery(int idx, uint16_t offset, int32_t value);
+static void battery_init(void);
+static void battery_curve_init(struct lcz_lwm2m_ble_sensor_battery_curve *curve, int product_id,
+			       uint8_t *level, uint8_t (*get_level)(double voltage));
+static uint8_t battery_level(int product_id, int32_t mv);
+#endif
+#if defined(CONFIG_LCZ_LWM2M_FILL_LEVEL)
+static int set_fill_level(int idx, uint16_t offset, int32_t value);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEADBAND)
+static bool deadband_check(const struct obj_update *u, bool bypass);
+#else
+static bool value_changed(const struct obj_update *u, bool bypass);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SIGNAL)
+static void signal_update(int idx, int8_t rssi);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT)
+static void evict(int8_t rssi);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SAMPLES)
+static struct sample_ring *sample_ring_find(int idx, uint8_t channel);
+static void sample_add(const struct obj_update *u);
+static void sample_free(int idx);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH)
+static void batch_add(const struct obj_update *u);
+static void batch_remove(const struct obj_update *u);
+static void batch_flush(struct ingest *in);
+static void batch_work_handler(struct k_work *work);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEFERRED)
+static void ad_enqueue(int idx, LczSensorAdEvent_t *p, int8_t rssi);
+static bool ad_dequeue(struct ingest *in, struct ad_event *ev, bool *priority);
+static void ad_work_handler(struct k_work *work);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+static bool ad_superseded(struct ingest *in, const struct ad_event *ev, bool priority);
+#endif
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_QUEUE)
+static void create_enqueue(const bt_addr_le_t *addr, LczSensorAdEvent_t *p, int8_t rssi);
+static void create_work_handler(struct k_work *work);
+static k_timeout_t create_delay(void);
+#endif
+
+static void ad_parse(struct net_buf_simple *ad, struct ad_desc *desc);
+static void name_handler(int idx, const AdHandle_t *name);
+static uint32_t fnv1a(const void *data, size_t len);
+static void name_settle(int idx, uint32_t hash);
+static void name_work_handler(struct k_work *work);
+static int rsp_handler(const bt_addr_le_t *addr, LczSensorRsp_t *p);
+
+static int gw_obj_removed(int idx, void *context);
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+static int persist_settings_set(const char *name, size_t len, settings_read_cb read_cb,
+				void *cb_arg);
+static void persist_restore(int idx, const bt_addr_le_t *addr);
+static void persist_changed(void);
+static void persist_work_handler(struct k_work *work);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ADAPTIVE_SCAN) ||                                         \
+	defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ACCEPT_LIST)
+static void scan_restart(void);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ACCEPT_LIST)
+static int accept_list_load(void);
+static void accept_list_work_handler(struct k_work *work);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ADAPTIVE_SCAN)
+static void scan_set_parameters(bool steady);
+static void scan_apply(bool steady);
+static bool scan_all_reporting(void);
+static void scan_work_handler(struct k_work *work);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE)
+static bool scan_all_tracked(void);
+static void scan_schedule_set(bool scheduled);
+static void scan_window_work_handler(struct k_work *work);
+#endif
+#endif
+
+static inline uint32_t timing_start(void);
+static inline void timing_stop(enum lcz_lwm2m_ble_sensor_stage stage, uint32_t start);
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_LOG_LEVEL_DBG)
+static const char *get_name(int idx, char *name, size_t size);
+#endif
+
+/* Built-in decoders; only contains the objects that are enabled */
+#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE)
+static const uint8_t temperature_s16_types[] = { SENSOR_EVENT_TEMPERATURE };
+static const uint8_t temperature_float_types[] = { SENSOR_EVENT_TEMPERATURE_1,
+						   SENSOR_EVENT_TEMPERATURE_2,
+						   SENSOR_EVENT_TEMPERATURE_3,
+						   SENSOR_EVENT_TEMPERATURE_4 };
+
+LCZ_LWM2M_BLE_SENSOR_DECODER_DEFINE(lbs_temperature_s16,
+				    LCZ_LWM2M_BLE_SENSOR_DECODER_TYPES(temperature_s16_types),
+				    .obj = OBJ_TEMPERATURE, .scale = FIXED_SCALE / 100,
+				    .decode = decode_s16, .set = set_temperature);
+
+LCZ_LWM2M_BLE_SENSOR_DECODER_DEFINE(lbs_temperature_float,
+				    LCZ_LWM2M_BLE_SENSOR_DECODER_TYPES(temperature_float_types),
+				    .obj = OBJ_TEMPERATURE, .scale = FIXED_SCALE,
+				    .decode = decode_float, .set = set_temperature);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BATTERY)
+/* Both events update the same resource instance */
+static const uint8_t battery_types[] = { SENSOR_EVENT_BATTERY_GOOD, SENSOR_EVENT_BATTERY_BAD };
+static const uint8_t battery_offsets[] = { 0, 0 };
+static const uint16_t battery_bt510_products[] = { BT510_PRODUCT_ID };
+static const uint16_t battery_bt6xx_products[] = { BT6XX_PRODUCT_ID };
+
+/* Battery voltage is reported in mV; its format depends on the sensor type */
+LCZ_LWM2M_BLE_SENSOR_DECODER_DEFINE(lbs_battery_bt510,
+				    LCZ_LWM2M_BLE_SENSOR_DECODER_TYPES(battery_types),
+				    .offsets = battery_offsets,
+				    LCZ_LWM2M_BLE_SENSOR_DECODER_PRODUCTS(battery_bt510_products),
+				    .obj = OBJ_BATTERY, .scale = FIXED_SCALE / 1000,
+				    .decode = decode_u16, .set = set_battery);
+
+LCZ_LWM2M_BLE_SENSOR_DECODER_DEFINE(lbs_battery_bt6xx,
+				    LCZ_LWM2M_BLE_SENSOR_DECODER_TYPES(battery_types),
+				    .offsets = battery_offsets,
+				    LCZ_LWM2M_BLE_SENSOR_DECODER_PRODUCTS(battery_bt6xx_products),
+				    .obj = OBJ_BATTERY, .scale = FIXED_SCALE / 1000,
+				    .decode = decode_s32, .set = set_battery);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_CURRENT)
+static const uint8_t current_types[] = { SENSOR_EVENT_CURRENT_1, SENSOR_EVENT_CURRENT_2,
+					 SENSOR_EVENT_CURRENT_3, SENSOR_EVENT_CURRENT_4 };
+
+LCZ_LWM2M_BLE_SENSOR_DECODER_DEFINE(lbs_current, LCZ_LWM2M_BLE_SENSOR_DECODER_TYPES(current_types),
+				    .obj = OBJ_CURRENT, .scale = FIXED_SCALE,
+				    .decode = decode_float, .set = set_current);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_PRESSURE)
+static const uint8_t pressure_types[] = { SENSOR_EVENT_PRESSURE_1, SENSOR_EVENT_PRESSURE_2 };
+
+LCZ_LWM2M_BLE_SENSOR_DECODER_DEFINE(lbs_pressure,
+				    LCZ_LWM2M_BLE_SENSOR_DECODER_TYPES(pressure_types),
+				    .obj = OBJ_PRESSURE, .scale = FIXED_SCALE,
+				    .decode = decode_float, .set = set_pressure);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_FILL_LEVEL)
+static const uint8_t fill_level_types[] = { SENSOR_EVENT_ULTRASONIC_1 };
+
+/* Convert from mm (reported) to cm (filling sensor) */
+LCZ_LWM2M_BLE_SENSOR_DECODER_DEFINE(lbs_fill_level,
+				    LCZ_LWM2M_BLE_SENSOR_DECODER_TYPES(fill_level_types),
+				    .obj = OBJ_FILL_LEVEL, .scale = FIXED_SCALE / 10,
+				    .decode = decode_float, .set = set_fill_level);
+#endif
+
+static const char *const stat_names[] = {
+	[LCZ_LWM2M_BLE_SENSOR_STAT_ADS] = "ads",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_LEGACY_ADS] = "legacy_ads",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_RSP_ADS] = "rsp_ads",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_CODED_ADS] = "coded_ads",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_ACCEPTED_ADS] = "accepted_ads",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_INDEXED_ADS] = "indexed_ads",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_DUPLICATE_ADS] = "duplicate_ads",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_PROCESSED_ADS] = "processed_ads",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_SET_EVENTS] = "set_events",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_SET_ERRORS] = "set_errors",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_NAME_UPDATES] = "name_updates",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_INDEX_MISSES] = "index_misses",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_LOOKUP_MISSES] = "lookup_misses",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_CREATES] = "creates",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_CREATE_ENOMEM] = "create_enomem",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_CREATE_EPERM] = "create_eperm",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_CREATE_OTHER] = "create_other",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_CREATE_DROPS] = "create_drops",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_QUEUE_DROPS] = "queue_drops",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_BATCH_MERGES] = "batch_merges",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_DEDUP_LOOKUPS] = "dedup_lookups",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_DEDUP_HITS] = "dedup_hits",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_DEADBAND_DROPS] = "deadband_drops",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_PRIORITY_ADS] = "priority_ads",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_SAMPLE_DROPS] = "sample_drops",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_WEAK_ADS] = "weak_ads",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_EVICTIONS] = "evictions",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_REJECT_HITS] = "reject_hits",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_SCAN_WINDOWS] = "scan_windows",
+	[LCZ_LWM2M_BLE_SENSOR_STAT_UNCHANGED_DROPS] = "unchanged_drops",
+};
+BUILD_ASSERT(ARRAY_SIZE(stat_names) == LCZ_LWM2M_BLE_SENSOR_STAT_COUNT);
+
+static const char *const stage_names[] = {
+	[LCZ_LWM2M_BLE_SENSOR_STAGE_HANDLER] = "ad_handler",
+	[LCZ_LWM2M_BLE_SENSOR_STAGE_FIND] = "find_type",
+	[LCZ_LWM2M_BLE_SENSOR_STAGE_MATCH] = "match",
+	[LCZ_LWM2M_BLE_SENSOR_STAGE_INDEX] = "get_index",
+	[LCZ_LWM2M_BLE_SENSOR_STAGE_PROCESS] = "ad_process",
+	[LCZ_LWM2M_BLE_SENSOR_STAGE_LIFETIME] = "set_lifetime",
+	[LCZ_LWM2M_BLE_SENSOR_STAGE_FLUSH] = "batch_flush",
+};
+BUILD_ASSERT(ARRAY_SIZE(stage_names) == LCZ_LWM2M_BLE_SENSOR_STAGE_COUNT);
+
+#define OBJ_CHANNELS(_obj)                                                                         \
+	{                                                                                          \
+		.base = CHANNEL_##_obj, .count = CHANNEL_##_obj##_LAST - CHANNEL_##_obj + 1        \
+	}
+
+/* Objects that aren't enabled have no channels.
+ * Custom objects are assigned channels when the decoders are registered.
+ */
+static struct obj_channels obj_channels[OBJ_COUNT] = {
+#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE)
+	[OBJ_TEMPERATURE] = OBJ_CHANNELS(TEMPERATURE),
+#endif
+#if defined(CONFIG_LCZ_LWM2M_CURRENT)
+	[OBJ_CURRENT] = OBJ_CHANNELS(CURRENT),
+#endif
+#if defined(CONFIG_LCZ_LWM2M_PRESSURE)
+	[OBJ_PRESSURE] = OBJ_CHANNELS(PRESSURE),
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BATTERY)
+	[OBJ_BATTERY] = OBJ_CHANNELS(BATTERY),
+#endif
+#if defined(CONFIG_LCZ_LWM2M_FILL_LEVEL)
+	[OBJ_FILL_LEVEL] = OBJ_CHANNELS(FILL_LEVEL),
+#endif
+};
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEADBAND)
+/* Thresholds are configured in thousandths of the LwM2M unit (FIXED_SCALE) */
+#define DEADBAND_CONFIG(_obj)                                                                      \
+	{                                                                                          \
+		.delta = CONFIG_LCZ_LWM2M_BLE_SENSOR_DEADBAND_##_obj,                              \
+		.min_interval = CONFIG_LCZ_LWM2M_BLE_SENSOR_DEADBAND_##_obj##_MIN_INTERVAL,        \
+		.max_silence = CONFIG_LCZ_LWM2M_BLE_SENSOR_DEADBAND_##_obj##_MAX_SILENCE,          \
+	}
+
+static const struct deadband_config deadband_config[OBJ_COUNT] = {
+#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE)
+	[OBJ_TEMPERATURE] = DEADBAND_CONFIG(TEMPERATURE),
+#endif
+#if defined(CONFIG_LCZ_LWM2M_CURRENT)
+	[OBJ_CURRENT] = DEADBAND_CONFIG(CURRENT),
+#endif
+#if defined(CONFIG_LCZ_LWM2M_PRESSURE)
+	[OBJ_PRESSURE] = DEADBAND_CONFIG(PRESSURE),
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BATTERY)
+	[OBJ_BATTERY] = DEADBAND_CONFIG(BATTERY),
+#endif
+#if defined(CONFIG_LCZ_LWM2M_FILL_LEVEL)
+	[OBJ_FILL_LEVEL] = DEADBAND_CONFIG(FILL_LEVEL),
+#endif
+};
+#endif
+
+/**************************************************************************************************/
+/* SYS INIT                                                                                       */
+/**************************************************************************************************/
+static int lcz_lwm2m_ble_sensor_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+	int idx;
+	int r;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEFERRED)
+	struct k_work_queue_config cfg = { .name = "lwm2m_ble_sensor" };
+	struct ingest *in;
+	int n;
+#endif
+
+	for (idx = 0; idx < MAX_INSTANCES; idx++) {
+		lbs.product_id[idx] = (uint16_t)INVALID_PRODUCT_ID;
+	}
+
+	lbs.create_min_rssi = CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_MIN_RSSI;
+
+	decoder_init();
+
+	for (idx = 0; idx < ADDR_INDEX_SIZE; idx++) {
+		lbs.addr_index[idx] = ADDR_INDEX_EMPTY;
+	}
+
+#if defined(CONFIG_LCZ_LWM2M_BATTERY)
+	battery_init();
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY_BATTERY_BAD)
+	atomic_set_bit(lbs.priority, SENSOR_EVENT_BATTERY_BAD);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEFERRED)
+	for (n = 0; n < INGEST_COUNT; n++) {
+		in = &lbs.ingest[n];
+		k_msgq_init(&in->msgq, lbs_msgq_buffer[n], sizeof(struct ad_event),
+			    CONFIG_LCZ_LWM2M_BLE_SENSOR_QUEUE_DEPTH);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+		k_msgq_init(&in->priority_msgq, lbs_priority_msgq_buffer[n],
+			    sizeof(struct ad_event),
+			    CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY_QUEUE_DEPTH);
+#endif
+		k_work_init(&in->work, ad_work_handler);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH)
+		k_work_init_delayable(&in->batch_work, batch_work_handler);
+#endif
+		k_work_queue_init(&in->workq);
+		k_work_queue_start(&in->workq, lbs_workq_stack[n],
+				   K_THREAD_STACK_SIZEOF(lbs_workq_stack[n]),
+				   CONFIG_LCZ_LWM2M_BLE_SENSOR_WORKQ_PRIORITY, &cfg);
+	}
+#endif
+
+	/* A single scan user parses each ad once; ad_enqueue hands it to the device's instance */
+	if (!lcz_bt_scan_register(&lbs.scan_user_id, SCAN_HANDLER)) {
+		LOG_ERR("LWM2M sensor module failed to register with scan module");
+	}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_QUEUE)
+	k_work_init_delayable(&lbs.create_work, create_work_handler);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ACCEPT_LIST)
+	k_work_init(&lbs.accept_list_work, accept_list_work_handler);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE)
+	k_sem_init(&lbs.rx_idle, 0, 1);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+	/* Restore before scanning starts so that the first ad of each device uses it */
+	k_work_init_delayable(&lbs.persist_work, persist_work_handler);
+	r = settings_subsys_init();
+	if (r == 0) {
+		r = settings_load_subtree(PERSIST_SUBTREE);
+	}
+	if (r < 0) {
+		LOG_ERR("Unable to load device state: %d", r);
+	}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ADAPTIVE_SCAN)
+	scan_set_parameters(false);
+	k_work_init_delayable(&lbs.scan_work, scan_work_handler);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE)
+	k_work_init_delayable(&lbs.scan_window_work, scan_window_work_handler);
+#endif
+	k_work_schedule(&lbs.scan_work, K_SECONDS(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_EVAL_SECONDS));
+#endif
+
+	r = lcz_bt_scan_update_parameters(lbs.scan_user_id, &scan_parameters);
+	if (r < 0) {
+		LOG_ERR("Unable to update scan parameters: %d", r);
+	}
+	r = lcz_bt_scan_start(lbs.scan_user_id);
+	if (r < 0) {
+		LOG_ERR("Unable to start scanning: %d", r);
+	}
+
+	k_work_init_delayable(&lbs.name_work, name_work_handler);
+	if (CONFIG_LCZ_LWM2M_BLE_SENSOR_NAME_RECHECK_SECONDS > 0) {
+		k_work_schedule(&lbs.name_work,
+				K_SECONDS(CONFIG_LCZ_LWM2M_BLE_SENSOR_NAME_RECHECK_SECONDS));
+	}
+
+	lbs.agent.gw_obj_deleted = gw_obj_removed;
+	lcz_lwm2m_util_register_agent(&lbs.agent);
+
+	return 0;
+}
+
+SYS_INIT(lcz_lwm2m_ble_sensor_init, APPLICATION, LCZ_LWM2M_UTIL_USER_INIT_PRIORITY);
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+SETTINGS_STATIC_HANDLER_DEFINE(lwm2m_ble_sensor, PERSIST_SUBTREE, NULL, persist_settings_set, NULL,
+			       NULL);
+#endif
+
+/**************************************************************************************************/
+/* Occurs in BT RX Thread context                                                                 */
+/**************************************************************************************************/
+static inline int ingest_index(const bt_addr_le_t *addr)
+{
+	return (INGEST_COUNT > 1) ? (int)(addr_hash(addr) % INGEST_COUNT) : 0;
+}
+
+static inline struct ingest *ingest_of(int idx)
+{
+	return &lbs.ingest[ingest_index(&lbs.addr[idx])];
+}
+
+static void ad_handler(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+		       struct net_buf_simple *ad)
+{
+	int idx;
+	LczSensorAdCoded_t *coded;
+	struct ad_desc desc;
+	uint32_t handler_start;
+	uint32_t start;
+
+	handler_start = timing_start();
+	INCR_STAT(ADS);
+
+	start = timing_start();
+	ad_parse(ad, &desc);
+	timing_stop(LCZ_LWM2M_BLE_SENSOR_STAGE_FIND, start);
+
+	/* Only one of these types can occur at a time.
+	 * The are ordered by probability of occurrence.
+	 */
+	start = timing_start();
+	if (lcz_sensor_adv_match_1m(&desc.mfg)) {
+		desc.format = AD_FORMAT_1M;
+	} else if (lcz_sensor_adv_match_coded(&desc.mfg)) {
+		desc.format = AD_FORMAT_CODED;
+	} else if (lcz_sensor_adv_match_rsp(&desc.mfg)) {
+		desc.format = AD_FORMAT_RSP;
+	} else {
+		desc.format = AD_FORMAT_NONE;
+	}
+	timing_stop(LCZ_LWM2M_BLE_SENSOR_STAGE_MATCH, start);
+
+	switch (desc.format) {
+	case AD_FORMAT_1M:
+		ad_filter(addr, (LczSensorAdEvent_t *)desc.mfg.pPayload, rssi);
+		INCR_STAT(LEGACY_ADS);
+		break;
+
+	case AD_FORMAT_CODED:
+		INCR_STAT(CODED_ADS);
+		/* The coded phy contains the TLVs of the 1M ad and scan response */
+		coded = (LczSensorAdCoded_t *)desc.mfg.pPayload;
+		ad_filter(addr, &coded->ad, rssi);
+		idx = rsp_handler(addr, &coded->rsp);
+		name_handler(idx, &desc.name);
+		break;
+
+	case AD_FORMAT_RSP:
+		INCR_STAT(RSP_ADS);
+		idx = rsp_handler(addr, &(((LczSensorRspWithHeader_t *)desc.mfg.pPayload)->rsp));
+		name_handler(idx, &desc.name);
+		break;
+
+	default:
+		break;
+	}
+
+	timing_stop(LCZ_LWM2M_BLE_SENSOR_STAGE_HANDLER, handler_start);
+}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE)
+/* Record what the scanner delivers before it is processed */
+static void capture_handler(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+			    struct net_buf_simple *ad)
+{
+	struct lcz_lwm2m_ble_sensor_capture_record record;
+	k_spinlock_key_t key;
+	size_t size;
+
+	/* Replayed ads use the state that is otherwise only accessed by the BT RX thread */
+	atomic_inc(&lbs.rx_active);
+	if (atomic_get(&lbs.replay_busy) != 0) {
+		rx_done();
+		return;
+	}
+
+	size = CAPTURE_HEADER_SIZE + ad->len;
+	if (atomic_get(&lbs.capture_active) != 0 && ad->len <= CAPTURE_AD_MAX &&
+	    size <= CAPTURE_SIZE) {
+		record.timestamp = k_uptime_get_32();
+		bt_addr_le_copy(&record.addr, addr);
+		record.rssi = rssi;
+		record.type = type;
+		record.len = ad->len;
+
+		key = k_spin_lock(&lbs.capture_lock);
+		while ((CAPTURE_SIZE - lbs.capture_used) < size) {
+			struct lcz_lwm2m_ble_sensor_capture_record oldest;
+			size_t oldest_size;
+
+			capture_copy_out(0, &oldest, CAPTURE_HEADER_SIZE);
+			oldest_size = CAPTURE_HEADER_SIZE + oldest.len;
+			lbs.capture_head = (lbs.capture_head + oldest_size) % CAPTURE_SIZE;
+			lbs.capture_used -= oldest_size;
+		}
+		capture_copy_in(lbs.capture_used, &record, CAPTURE_HEADER_SIZE);
+		capture_copy_in(lbs.capture_used + CAPTURE_HEADER_SIZE, ad->data, ad->len);
+		lbs.capture_used += size;
+		k_spin_unlock(&lbs.capture_lock, key);
+	}
+
+	ad_handler(addr, rssi, type, ad);
+	rx_done();
+}
+
+static void rx_done(void)
+{
+	if (atomic_dec(&lbs.rx_active) == 1 && atomic_get(&lbs.replay_busy) != 0) {
+		k_sem_give(&lbs.rx_idle);
+	}
+}
+#endif
+
+/**************************************************************************************************/
+/* Local Function Definitions                                                                     */
+/**************************************************************************************************/
+/* Find the manufacturer data and the local name in one pass over the AD structures.
+ * The first structure of each kind is used, which matches AdFind_Type/AdFind_Name.
+ */
+static void ad_parse(struct net_buf_simple *ad, struct ad_desc *desc)
+{
+	const uint8_t *end = ad->data + ad->len;
+	uint8_t *p = ad->data;
+	uint8_t len;
+
+	memset(desc, 0, sizeof(*desc));
+
+	/* Each structure is a length byte followed by a type and (length - 1) bytes of data */
+	while ((end - p) > 1) {
+		len = p[0];
+		if (len == 0 || len > (end - p - 1)) {
+			break;
+		}
+
+		switch (p[1]) {
+		case BT_DATA_MANUFACTURER_DATA:
+			if (desc->mfg.pPayload == NULL) {
+				desc->mfg.pPayload = &p[2];
+				desc->mfg.size = len - 1;
+			}
+			break;
+
+		case BT_DATA_NAME_COMPLETE:
+		case BT_DATA_NAME_SHORTENED:
+			if (desc->name.pPayload == NULL) {
+				desc->name.pPayload = &p[2];
+				desc->name.size = len - 1;
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		if (desc->mfg.pPayload != NULL && desc->name.pPayload != NULL) {
+			break;
+		}
+
+		p += len + 1;
+	}
+}
+
+static bool valid_index(int idx)
+{
+	return (idx >= 0 && idx < MAX_INSTANCES);
+}
+
+static int get_index(const bt_addr_le_t *addr, bool add)
+{
+	int idx;
+
+	/* The gateway object lookup is a linear search; try the local index first */
+	idx = addr_index_lookup(addr);
+	if (valid_index(idx)) {
+		return idx;
+	}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE)
+	/* Most ads at a busy site are from devices that won't be added */
+	if (reject_check(addr)) {
+		INCR_STAT(REJECT_HITS);
+		return INDEX_REJECTED;
+	}
+#endif
+
+	INCR_STAT(INDEX_MISSES);
+	idx = lcz_lwm2m_gw_obj_lookup_ble(addr);
+	if (valid_index(idx)) {
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+		persist_restore(idx, addr);
+#endif
+		addr_index_add(addr, idx);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ACCEPT_LIST)
+		/* The accept list can't be loaded until every device is in the local index */
+		if (atomic_get(&lbs.table_full)) {
+			k_work_submit(&lbs.accept_list_work);
+		}
+#endif
+	} else {
+		INCR_STAT(LOOKUP_MISSES);
+	}
+
+	/* If the device isn't in the database,
+	 * the ad has been filtered, the table isn't full, and it isn't blocked;
+	 * try to add it.
+	 */
+	if (!valid_index(idx) && add && !atomic_get(&lbs.table_full)) {
+		idx = create_device(addr);
+		if (valid_index(idx)) {
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+			persist_restore(idx, addr);
+#endif
+			addr_index_add(addr, idx);
+		}
+	}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE) && !defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT)
+	/* The cache is cleared when a device is removed.
+	 * With eviction, ads from new devices must still reach the eviction check.
+	 */
+	if (!valid_index(idx) && atomic_get(&lbs.table_full)) {
+		reject_add(addr);
+	}
+#endif
+
+	if (idx >= MAX_INSTANCES) {
+		LOG_ERR("Invalid index");
+		return -EPERM;
+	}
+
+	return idx;
+}
+
+static int create_device(const bt_addr_le_t *addr)
+{
+	int idx;
+
+	idx = lcz_lwm2m_gw_obj_create(addr);
+	if (valid_index(idx)) {
+		INCR_STAT(CREATES);
+	} else if (idx == -ENOMEM) {
+		INCR_STAT(CREATE_ENOMEM);
+	} else if (idx == -EPERM) {
+		INCR_STAT(CREATE_EPERM);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE)
+		reject_add(addr);
+#endif
+	} else {
+		INCR_STAT(CREATE_OTHER);
+	}
+
+	/* Only format the address and name when they are logged.
+	 * Limit logging for blocked devices.
+	 */
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_LOG_LEVEL_DBG)
+	if (idx != -EPERM || IS_ENABLED(CONFIG_LCZ_LWM2M_BLE_CREATE_LOG_VERBOSE)) {
+		char addr_str[BT_ADDR_LE_STR_LEN];
+		char name[SENSOR_NAME_MAX_SIZE];
+
+		bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
+		LOG_DBG("Gateway object create request %s: idx: %d inst: %d name: %s", addr_str,
+			idx, lcz_lwm2m_gw_obj_get_instance(idx), get_name(idx, name, sizeof(name)));
+	}
+#endif
+	if (idx == -ENOMEM) {
+		atomic_set(&lbs.table_full, 1);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ACCEPT_LIST)
+		k_work_submit(&lbs.accept_list_work);
+#endif
+	}
+
+	return idx;
+}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_QUEUE)
+/* Occurs in BT RX thread context.
+ * A device that is already waiting keeps its place and the newest event.
+ */
+static void create_enqueue(const bt_addr_le_t *addr, LczSensorAdEvent_t *p, int8_t rssi)
+{
+	struct create_request *req = NULL;
+	k_timeout_t delay;
+	k_spinlock_key_t key;
+	size_t i;
+
+	key = k_spin_lock(&lbs.create_lock);
+	for (i = 0; i < lbs.create_count; i++) {
+		req = &lbs.create[(lbs.create_head + i) % CREATE_QUEUE_SIZE];
+		if (bt_addr_le_cmp(&req->addr, addr) == 0) {
+			break;
+		}
+		req = NULL;
+	}
+
+	if (req == NULL && lbs.create_count < CREATE_QUEUE_SIZE) {
+		req = &lbs.create[(lbs.create_head + lbs.create_count) % CREATE_QUEUE_SIZE];
+		bt_addr_le_copy(&req->addr, addr);
+		lbs.create_count += 1;
+	}
+
+	if (req != NULL) {
+		memcpy(&req->ad, p, sizeof(req->ad));
+		req->rssi = rssi;
+	}
+	delay = create_delay();
+	k_spin_unlock(&lbs.create_lock, key);
+
+	if (req == NULL) {
+		INCR_STAT(CREATE_DROPS);
+	} else {
+		k_work_schedule_for_queue(&lbs.ingest[0].workq, &lbs.create_work, delay);
+	}
+}
+
+/* Must be called with the create lock held */
+static k_timeout_t create_delay(void)
+{
+	int64_t elapsed = k_uptime_get() - lbs.create_time;
+
+	if (lbs.create_time == 0 || elapsed >= CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_INTERVAL_MS) {
+		return K_NO_WAIT;
+	}
+
+	return K_MSEC(CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_INTERVAL_MS - elapsed);
+}
+
+/* Occurs in sensor work queue context.
+ * Create one device at a time and then process its buffered event.
+ */
+static void create_work_handler(struct k_work *work)
+{
+	struct create_request req;
+	k_spinlock_key_t lock_key;
+	k_timeout_t delay;
+	size_t remaining;
+	bool claimed;
+	uint32_t key;
+	int idx;
+
+	ARG_UNUSED(work);
+
+	lock_key = k_spin_lock(&lbs.create_lock);
+	remaining = lbs.create_count;
+	if (remaining > 0) {
+		memcpy(&req, &lbs.create[lbs.create_head], sizeof(req));
+		lbs.create_head = (lbs.create_head + 1) % CREATE_QUEUE_SIZE;
+		lbs.create_count -= 1;
+	}
+	k_spin_unlock(&lbs.create_lock, lock_key);
+
+	if (remaining == 0) {
+		return;
+	}
+
+	/* The device may have been added after it was queued */
+	idx = lcz_lwm2m_gw_obj_lookup_ble(&req.addr);
+	if (!valid_index(idx) && !atomic_get(&lbs.table_full)) {
+		idx = create_device(&req.addr);
+		lock_key = k_spin_lock(&lbs.create_lock);
+		lbs.create_time = k_uptime_get();
+		k_spin_unlock(&lbs.create_lock, lock_key);
+	}
+
+	if (valid_index(idx)) {
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+		persist_restore(idx, &req.addr);
+#endif
+		/* Record the event before the device is visible to the BT RX thread */
+		key = EVENT_KEY(req.ad.recordType, req.ad.id);
+		claimed = event_claim(idx, &req.ad, key);
+		addr_index_add(&req.addr, idx);
+		if (claimed && INGEST_COUNT > 1) {
+			/* The device's events are processed by its own ingest instance */
+			ad_enqueue(idx, &req.ad, req.rssi);
+		} else if (claimed) {
+			ad_update(idx, &req.ad, req.rssi);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH)
+			/* Write the first event now instead of with the next ad */
+			if (CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH_WINDOW_MS == 0) {
+				batch_flush(ingest_of(idx));
+			}
+#endif
+		}
+	}
+
+	if (remaining > 1) {
+		lock_key = k_spin_lock(&lbs.create_lock);
+		delay = create_delay();
+		k_spin_unlock(&lbs.create_lock, lock_key);
+		k_work_schedule_for_queue(&lbs.ingest[0].workq, &lbs.create_work, delay);
+	}
+}
+#endif
+
+static uint32_t addr_hash(const bt_addr_le_t *addr)
+{
+	return fnv1a(addr, sizeof(*addr));
+}
+
+static int addr_index_lookup(const bt_addr_le_t *addr)
+{
+	k_spinlock_key_t key;
+	size_t slot;
+	int idx = -ENOENT;
+
+	slot = addr_hash(addr) % ADDR_INDEX_SIZE;
+
+	key = k_spin_lock(&lbs.addr_index_lock);
+	while (lbs.addr_index[slot] != ADDR_INDEX_EMPTY) {
+		if (bt_addr_le_cmp(&lbs.addr[lbs.addr_index[slot]], addr) == 0) {
+			idx = lbs.addr_index[slot];
+			break;
+		}
+		slot = (slot + 1) % ADDR_INDEX_SIZE;
+	}
+	k_spin_unlock(&lbs.addr_index_lock, key);
+
+	return idx;
+}
+
+static void addr_index_add(const bt_addr_le_t *addr, int idx)
+{
+	k_spinlock_key_t key;
+	size_t slot;
+
+	key = k_spin_lock(&lbs.addr_index_lock);
+	if (lbs.addr_indexed[idx]) {
+		if (bt_addr_le_cmp(&lbs.addr[idx], addr) == 0) {
+			k_spin_unlock(&lbs.addr_index_lock, key);
+			return;
+		}
+		/* The index was reused without a removal callback */
+		addr_index_remove_locked(idx);
+	}
+
+	slot = addr_hash(addr) % ADDR_INDEX_SIZE;
+	while (lbs.addr_index[slot] != ADDR_INDEX_EMPTY) {
+		slot = (slot + 1) % ADDR_INDEX_SIZE;
+	}
+	bt_addr_le_copy(&lbs.addr[idx], addr);
+	lbs.addr_index[slot] = idx;
+	lbs.addr_indexed[idx] = true;
+	k_spin_unlock(&lbs.addr_index_lock, key);
+}
+
+static void addr_index_remove(int idx)
+{
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&lbs.addr_index_lock);
+	if (lbs.addr_indexed[idx]) {
+		addr_index_remove_locked(idx);
+	}
+	k_spin_unlock(&lbs.addr_index_lock, key);
+}
+
+/* Backward-shift deletion keeps probe sequences intact without tombstones */
+static void addr_index_remove_locked(int idx)
+{
+	size_t slot;
+	size_t next;
+	size_t home;
+
+	slot = addr_hash(&lbs.addr[idx]) % ADDR_INDEX_SIZE;
+	while (lbs.addr_index[slot] != idx) {
+		slot = (slot + 1) % ADDR_INDEX_SIZE;
+	}
+
+	lbs.addr_index[slot] = ADDR_INDEX_EMPTY;
+	lbs.addr_indexed[idx] = false;
+
+	next = (slot + 1) % ADDR_INDEX_SIZE;
+	while (lbs.addr_index[next] != ADDR_INDEX_EMPTY) {
+		home = addr_hash(&lbs.addr[lbs.addr_index[next]]) % ADDR_INDEX_SIZE;
+		/* Move the entry into the hole unless its home slot lies after the hole */
+		if (((next - home + ADDR_INDEX_SIZE) % ADDR_INDEX_SIZE) >=
+		    ((next - slot + ADDR_INDEX_SIZE) % ADDR_INDEX_SIZE)) {
+			lbs.addr_index[slot] = lbs.addr_index[next];
+			lbs.addr_index[next] = ADDR_INDEX_EMPTY;
+			slot = next;
+		}
+		next = (next + 1) % ADDR_INDEX_SIZE;
+	}
+}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEDUP_CACHE)
+static inline struct dedup_entry *dedup_entry(uint32_t hash, uint8_t record_type)
+{
+	return &lbs.dedup[(hash + (record_type * 0x9E3779B1U)) & (DEDUP_CACHE_SIZE - 1)];
+}
+
+/* Returns the index of the device if the event was recently seen, else -ENOENT */
+static int dedup_check(uint32_t hash, LczSensorAdEvent_t *p)
+{
+	struct dedup_entry *e;
+	k_spinlock_key_t key;
+	int idx = -ENOENT;
+
+	INCR_STAT(DEDUP_LOOKUPS);
+	key = k_spin_lock(&lbs.dedup_lock);
+	/* A device was removed; entries may refer to a reused index */
+	if (atomic_get(&lbs.dedup_flush) != 0 && atomic_clear(&lbs.dedup_flush) != 0) {
+		memset(lbs.dedup, 0, sizeof(lbs.dedup));
+	}
+
+	e = dedup_entry(hash, p->recordType);
+	if (e->valid && e->addr_hash == hash && e->event_id == p->id &&
+	    e->record_type == p->recordType) {
+		idx = e->idx;
+	}
+	k_spin_unlock(&lbs.dedup_lock, key);
+
+	if (idx >= 0) {
+		INCR_STAT(DEDUP_HITS);
+	}
+
+	return idx;
+}
+
+static void dedup_add(uint32_t hash, LczSensorAdEvent_t *p, int idx)
+{
+	struct dedup_entry *e = dedup_entry(hash, p->recordType);
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&lbs.dedup_lock);
+	e->addr_hash = hash;
+	e->event_id = p->id;
+	e->idx = (uint16_t)idx;
+	e->record_type = p->recordType;
+	e->valid = true;
+	k_spin_unlock(&lbs.dedup_lock, key);
+}
+
+/* Occurs in BT RX thread or sensor work queue context */
+static void dedup_invalidate(const bt_addr_le_t *addr, uint8_t record_type)
+{
+	uint32_t hash = addr_hash(addr);
+	struct dedup_entry *e = dedup_entry(hash, record_type);
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&lbs.dedup_lock);
+	if (e->addr_hash == hash && e->record_type == record_type) {
+		e->valid = false;
+	}
+	k_spin_unlock(&lbs.dedup_lock, key);
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE)
+static inline struct reject_entry *reject_entry(uint32_t hash)
+{
+	return &lbs.reject[hash & (REJECT_CACHE_SIZE - 1)];
+}
+
+/* Returns true if the device was recently rejected */
+static bool reject_check(const bt_addr_le_t *addr)
+{
+	uint32_t now = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+	uint32_t hash = addr_hash(addr);
+	struct reject_entry *e;
+	k_spinlock_key_t key;
+	bool rejected = false;
+
+	key = k_spin_lock(&lbs.reject_lock);
+	e = reject_entry(hash);
+	if (e->expires != 0 && e->addr_hash == hash) {
+		if ((int32_t)(e->expires - now) > 0) {
+			rejected = true;
+		} else {
+			e->expires = 0;
+		}
+	}
+	k_spin_unlock(&lbs.reject_lock, key);
+
+	return rejected;
+}
+
+static void reject_add(const bt_addr_le_t *addr)
+{
+	uint32_t now = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+	uint32_t hash = addr_hash(addr);
+	struct reject_entry *e;
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&lbs.reject_lock);
+	e = reject_entry(hash);
+	e->addr_hash = hash;
+	e->expires = MAX(now + CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE_SECONDS, 1);
+	k_spin_unlock(&lbs.reject_lock, key);
+}
+
+static void reject_clear(void)
+{
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&lbs.reject_lock);
+	memset(lbs.reject, 0, sizeof(lbs.reject));
+	k_spin_unlock(&lbs.reject_lock, key);
+}
+#endif
+
+static int ad_filter(const bt_addr_le_t *addr, LczSensorAdEvent_t *p, int8_t rssi)
+{
+	int idx = -EPERM;
+	uint32_t start;
+	uint32_t key;
+	bool strong;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEDUP_CACHE)
+	uint32_t hash;
+	int seen;
+#endif
+
+	do {
+		if (p == NULL) {
+			break;
+		}
+
+		/* Short circuit if event type isn't supported */
+		if (ad_discard(p)) {
+			break;
+		}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEDUP_CACHE)
+		/* Most ads are repeats; drop them without a lookup */
+		hash = addr_hash(addr);
+		seen = dedup_check(hash, p);
+		if (valid_index(seen)) {
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE)
+			/* The windows follow every ad of a device, not only its new events */
+			signal_update(seen, rssi);
+#endif
+			break;
+		}
+#endif
+
+		INCR_STAT(ACCEPTED_ADS);
+		/* Distant devices don't get a table slot, but known devices aren't dropped */
+		strong = (rssi >= lbs.create_min_rssi);
+		start = timing_start();
+		idx = get_index(addr,
+				strong && !IS_ENABLED(CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_QUEUE));
+		timing_stop(LCZ_LWM2M_BLE_SENSOR_STAGE_INDEX, start);
+		if (idx == INDEX_REJECTED) {
+			/* A rejected device isn't queued, counted as weak, or a reason to evict */
+			break;
+		}
+		if (!valid_index(idx)) {
+			if (!strong) {
+				INCR_STAT(WEAK_ADS);
+			}
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT)
+			else if (atomic_get(&lbs.table_full)) {
+				evict(rssi);
+			}
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_QUEUE)
+			else if (!atomic_get(&lbs.table_full)) {
+				create_enqueue(addr, p, rssi);
+			}
+#endif
+			break;
+		}
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT)
+		if (atomic_test_bit(lbs.evicting, idx)) {
+			break;
+		}
+#endif
+		INCR_STAT(INDEXED_ADS);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SIGNAL)
+		signal_update(idx, rssi);
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ADAPTIVE_SCAN) || defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT)
+		lbs.last_seen[idx] = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEDUP_CACHE)
+		dedup_add(hash, p, idx);
+#endif
+
+		/* Filter out duplicate events */
+		key = EVENT_KEY(p->recordType, p->id);
+		if (!event_claim(idx, p, key)) {
+			INCR_STAT(DUPLICATE_ADS);
+			break;
+		}
+
+		if (IS_ENABLED(CONFIG_LCZ_LWM2M_BLE_EVENT_LOG_VERBOSE)) {
+			LOG_INF("%s idx: %d RSSI: %d id: %u",
+				lcz_sensor_event_get_string(p->recordType), idx, rssi, p->id);
+		}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_LED)
+		lcz_led_blink(BLE_LED, &BLE_ACTIVITY_LED_PATTERN);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEFERRED)
+		ad_enqueue(idx, p, rssi);
+#else
+		ad_update(idx, p, rssi);
+#endif
+	} while (0);
+
+	return idx;
+}
+
+/* Update LwM2M resources; this takes the LwM2M engine lock */
+static void ad_update(int idx, LczSensorAdEvent_t *p, int8_t rssi)
+{
+	uint32_t now;
+	uint32_t start;
+	int r;
+
+	start = timing_start();
+	ad_process(idx, p, rssi);
+	timing_stop(LCZ_LWM2M_BLE_SENSOR_STAGE_PROCESS, start);
+
+	/* An ad that we care about has been seen; prevent device from being removed from table.
+	 * The lifetime only needs to be refreshed once a portion of it has elapsed.
+	 */
+	now = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+	if (lbs.lifetime_valid[idx] && (now - lbs.lifetime_refreshed[idx]) < LIFETIME_REFRESH) {
+		return;
+	}
+
+	start = timing_start();
+	r = lcz_lwm2m_gw_obj_set_lifetime(idx, LIFETIME);
+	timing_stop(LCZ_LWM2M_BLE_SENSOR_STAGE_LIFETIME, start);
+	if (r != 0) {
+		LOG_ERR("Unable to set lifetime");
+	} else {
+		lbs.lifetime_refreshed[idx] = now;
+		lbs.lifetime_valid[idx] = true;
+	}
+}
+
+/* Only valid for record types that aren't discarded */
+static inline uint8_t record_channel(uint8_t record_type)
+{
+	return obj_channels[lbs.decoder[record_type]->obj].base + lbs.decoder_offset[record_type];
+}
+
+/* Writers of the same device wait for each other; writers of different devices don't.
+ * Interrupts are locked on this CPU so that a writer can't be preempted while the counter
+ * is odd; only a writer on another CPU can be waited for, and only for a few stores.
+ */
+static unsigned int event_write_begin(int idx)
+{
+	unsigned int key = arch_irq_lock();
+	atomic_val_t seq;
+
+	do {
+		seq = atomic_get(&lbs.event_seq[idx]);
+	} while ((seq & 1) != 0 || !atomic_cas(&lbs.event_seq[idx], seq, seq + 1));
+
+	return key;
+}
+
+static void event_write_end(int idx, unsigned int key)
+{
+	atomic_inc(&lbs.event_seq[idx]);
+	arch_irq_unlock(key);
+}
+
+/* Returns false if the fields are being written */
+static bool event_read_begin(int idx, atomic_val_t *seq)
+{
+	*seq = atomic_get(&lbs.event_seq[idx]);
+
+	return ((*seq & 1) == 0);
+}
+
+/* Returns true if the fields were written while they were read */
+static bool event_read_retry(int idx, atomic_val_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (atomic_get(&lbs.event_seq[idx]) != seq);
+}
+
+/* The last event of any record type is checked first because repeats are the common case.
+ * The event fields must be read or write locked.
+ */
+static bool event_duplicate(int idx, const LczSensorAdEvent_t *p, uint32_t key)
+{
+	uint8_t channel;
+
+	if (lbs.last_event[idx] == key) {
+		return true;
+	}
+
+	channel = record_channel(p->recordType);
+	return ((lbs.channel_valid[idx] & BIT(channel)) != 0 &&
+		lbs.channel_event[idx][channel] == p->id);
+}
+
+/* The event fields must be write locked */
+static void event_record(int idx, const LczSensorAdEvent_t *p, uint32_t key)
+{
+	uint8_t channel = record_channel(p->recordType);
+
+	lbs.last_event[idx] = key;
+	lbs.channel_event[idx][channel] = p->id;
+	lbs.channel_valid[idx] |= BIT(channel);
+}
+
+/* Returns true, after recording the event, if it isn't a duplicate.
+ * Repeats are found without the lock; the check is repeated with the lock held
+ * before the event is recorded, so the same event can't be claimed twice.
+ */
+static bool event_claim(int idx, const LczSensorAdEvent_t *p, uint32_t key)
+{
+	unsigned int lock_key;
+	atomic_val_t seq;
+	bool duplicate;
+
+	if (event_read_begin(idx, &seq)) {
+		duplicate = event_duplicate(idx, p, key);
+		if (duplicate && !event_read_retry(idx, seq)) {
+			return false;
+		}
+	}
+
+	lock_key = event_write_begin(idx);
+	duplicate = event_duplicate(idx, p, key);
+	if (!duplicate) {
+		event_record(idx, p, key);
+	}
+	event_write_end(idx, lock_key);
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+	if (!duplicate) {
+		persist_changed();
+	}
+#endif
+
+	return !duplicate;
+}
+
+/* Returns true if the event was the last event of the device or its channel */
+static bool event_forget(int idx, const LczSensorAdEvent_t *p)
+{
+	uint8_t channel = record_channel(p->recordType);
+	bool forgotten = false;
+	unsigned int key;
+
+	key = event_write_begin(idx);
+	if (lbs.last_event[idx] == EVENT_KEY(p->recordType, p->id)) {
+		lbs.last_event[idx] = EVENT_KEY_NONE;
+		forgotten = true;
+	}
+
+	if ((lbs.channel_valid[idx] & BIT(channel)) != 0 &&
+	    lbs.channel_event[idx][channel] == p->id) {
+		lbs.channel_valid[idx] &= ~BIT(channel);
+		forgotten = true;
+	}
+	event_write_end(idx, key);
+
+	return forgotten;
+}
+
+static inline bool event_priority(uint8_t record_type)
+{
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+	return atomic_test_bit(lbs.priority, record_type);
+#else
+	ARG_UNUSED(record_type);
+	return false;
+#endif
+}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEFERRED)
+static void ad_enqueue(int idx, LczSensorAdEvent_t *p, int8_t rssi)
+{
+	struct ingest *in = ingest_of(idx);
+	struct ad_event ev;
+	struct ad_event old;
+
+	memcpy(&ev.ad, p, sizeof(ev.ad));
+	ev.idx = idx;
+	ev.gen = lbs.gen[idx];
+	ev.rssi = rssi;
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+	ev.seq = (uint32_t)atomic_inc(&in->seq);
+	/* When the priority queue is full, the event is queued as a routine event */
+	if (event_priority(p->recordType) &&
+	    k_msgq_put(&in->priority_msgq, &ev, K_NO_WAIT) == 0) {
+		k_work_submit_to_queue(&in->workq, &in->work);
+		return;
+	}
+#endif
+
+	while (k_msgq_put(&in->msgq, &ev, K_NO_WAIT) != 0) {
+		INCR_STAT(QUEUE_DROPS);
+		if (IS_ENABLED(CONFIG_LCZ_LWM2M_BLE_SENSOR_QUEUE_DROP_NEWEST) ||
+		    k_msgq_get(&in->msgq, &old, K_NO_WAIT) != 0) {
+			/* Allow a repeat of this event to be queued later */
+			event_forget(idx, p);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEDUP_CACHE)
+			dedup_invalidate(&lbs.addr[idx], p->recordType);
+#endif
+			break;
+		}
+
+		/* Allow a repeat of the dropped event to be queued later */
+		if (old.gen == lbs.gen[old.idx] && event_forget(old.idx, &old.ad)) {
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEDUP_CACHE)
+			dedup_invalidate(&lbs.addr[old.idx], old.ad.recordType);
+#endif
+		}
+	}
+
+	k_work_submit_to_queue(&in->workq, &in->work);
+}
+
+/* Priority events are taken first, even during a burst of routine events */
+static bool ad_dequeue(struct ingest *in, struct ad_event *ev, bool *priority)
+{
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+	if (k_msgq_get(&in->priority_msgq, ev, K_NO_WAIT) == 0) {
+		*priority = true;
+		return true;
+	}
+#endif
+
+	*priority = false;
+	return (k_msgq_get(&in->msgq, ev, K_NO_WAIT) == 0);
+}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+/* A routine event that was queued before a processed priority event of the same resource
+ * would overwrite the newer value.
+ */
+static bool ad_superseded(struct ingest *in, const struct ad_event *ev, bool priority)
+{
+	uint8_t channel = record_channel(ev->ad.recordType);
+
+	if (priority) {
+		lbs.priority_seq[ev->idx][channel] = ev->seq;
+		in->priority_valid[ev->idx] |= BIT(channel);
+		return false;
+	}
+
+	return ((in->priority_valid[ev->idx] & BIT(channel)) != 0 &&
+		(int32_t)(ev->seq - lbs.priority_seq[ev->idx][channel]) < 0);
+}
+#endif
+
+/* Occurs in sensor work queue context */
+static void ad_work_handler(struct k_work *work)
+{
+	struct ingest *in = CONTAINER_OF(work, struct ingest, work);
+	struct ad_event ev;
+	bool priority;
+
+	while (ad_dequeue(in, &ev, &priority)) {
+		/* Discard events for a device that was removed after the event was queued */
+		if (ev.gen != lbs.gen[ev.idx]) {
+			continue;
+		}
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+		if (ad_superseded(in, &ev, priority)) {
+			continue;
+		}
+#endif
+		ad_update(ev.idx, &ev.ad, ev.rssi);
+	}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+	/* Events queued from now on are newer than every priority event that was processed */
+	memset(in->priority_valid, 0, sizeof(in->priority_valid));
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH)
+	if (CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH_WINDOW_MS == 0) {
+		batch_flush(in);
+	}
+#endif
+}
+#endif
+
+/* Record types are filtered on if a decoder is registered for them */
+static bool ad_discard(const LczSensorAdEvent_t *p)
+{
+	return (lbs.decoder[p->recordType] == NULL);
+}
+
+static void ad_process(int idx, LczSensorAdEvent_t *p, int8_t rssi)
+{
+	struct obj_update u;
+	bool priority;
+	int r = -EPERM;
+
+	if (!ad_decode(idx, p, &u)) {
+		/* The event's decoders are for other products */
+		LOG_DBG("Unhandled advertisement event");
+	} else {
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SAMPLES)
+		/* Every reading is kept, including those that aren't written */
+		sample_add(&u);
+#endif
+		priority = event_priority(p->recordType);
+		if (priority) {
+			INCR_STAT(PRIORITY_ADS);
+		}
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEADBAND)
+		if (!deadband_check(&u, priority)) {
+			INCR_STAT(DEADBAND_DROPS);
+			return;
+		}
+#else
+		if (!value_changed(&u, priority)) {
+			INCR_STAT(UNCHANGED_DROPS);
+			return;
+		}
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH)
+		if (!priority) {
+			/* The result is counted when the batch is flushed */
+			batch_add(&u);
+			INCR_STAT(PROCESSED_ADS);
+			return;
+		}
+		/* A pending update of the resource is older and must not be written later */
+		batch_remove(&u);
+#endif
+		r = obj_set(&u);
+	}
+
+	INCR_STAT(PROCESSED_ADS);
+	if (r == 0) {
+		INCR_STAT(SET_EVENTS);
+	} else {
+		INCR_STAT(SET_ERRORS);
+	}
+}
+
+/* Convert the event into the value (and resource offset) of an LwM2M object */
+static bool ad_decode(int idx, const LczSensorAdEvent_t *p, struct obj_update *u)
+{
+	const struct lcz_lwm2m_ble_sensor_decoder *d;
+
+	d = decoder_find(p->recordType, lbs.product_id[idx]);
+	if (d == NULL) {
+		return false;
+	}
+
+	u->idx = idx;
+	u->obj = d->obj;
+	u->offset = lbs.decoder_offset[p->recordType];
+	u->channel = obj_channels[d->obj].base + u->offset;
+	u->value = d->decode(idx, p, d->scale);
+	u->set = d->set;
+
+	return true;
+}
+
+static inline int obj_set(const struct obj_update *u)
+{
+	int r = u->set(u->idx, u->offset, u->value);
+
+#if !defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEADBAND)
+	/* A value that wasn't written isn't dropped when it repeats */
+	if (r != 0) {
+		lbs.value_valid[u->idx] &= ~BIT(u->channel);
+	}
+#endif
+	return r;
+}
+
+/* Invalid decoders, and record types that another decoder writes to a different
+ * resource instance, are ignored.
+ */
+static void decoder_init(void)
+{
+	uint8_t base = CHANNEL_CUSTOM;
+	uint8_t record_type;
+	uint8_t obj;
+	size_t i;
+	int offset;
+
+	/* Each custom object has as many channels as the highest offset of its decoders */
+	STRUCT_SECTION_FOREACH (lcz_lwm2m_ble_sensor_decoder, d) {
+		if (d->obj < OBJ_CUSTOM || d->obj >= OBJ_COUNT) {
+			continue;
+		}
+		for (i = 0; i < d->record_count; i++) {
+			/* An offset that can't fit is reported when the table is built */
+			offset = decoder_offset(d, d->record_types[i]);
+			if (offset < DECODER_CHANNELS) {
+				obj_channels[d->obj].count =
+					MAX(obj_channels[d->obj].count, offset + 1);
+			}
+		}
+	}
+	for (obj = OBJ_CUSTOM; obj < OBJ_COUNT; obj++) {
+		if (base + obj_channels[obj].count > CHANNEL_COUNT) {
+			LOG_ERR("Not enough decoder channels for object %u", obj);
+			obj_channels[obj].count = 0;
+		}
+		obj_channels[obj].base = base;
+		base += obj_channels[obj].count;
+	}
+
+	STRUCT_SECTION_FOREACH (lcz_lwm2m_ble_sensor_decoder, d) {
+		if (d->decode == NULL || d->set == NULL || d->obj >= OBJ_COUNT) {
+			LOG_ERR("Invalid decoder");
+			continue;
+		}
+		for (i = 0; i < d->record_count; i++) {
+			record_type = d->record_types[i];
+			offset = decoder_offset(d, record_type);
+			if (offset >= obj_channels[d->obj].count) {
+				LOG_ERR("No resource instance %d of object %u", offset, d->obj);
+			} else if (lbs.decoder[record_type] == NULL) {
+				lbs.decoder[record_type] = d;
+				lbs.decoder_offset[record_type] = offset;
+			} else if (lbs.decoder[record_type]->obj != d->obj ||
+				   lbs.decoder_offset[record_type] != offset) {
+				LOG_ERR("Record type %u updates another resource", record_type);
+			} else {
+				atomic_set_bit(lbs.decoder_shared, record_type);
+			}
+		}
+	}
+}
+
+/* Returns -ENOENT if the decoder doesn't handle the record type */
+static int decoder_offset(const struct lcz_lwm2m_ble_sensor_decoder *d, uint8_t record_type)
+{
+	size_t i;
+
+	for (i = 0; i < d->record_count; i++) {
+		if (d->record_types[i] == record_type) {
+			return (d->offsets == NULL) ? i : d->offsets[i];
+		}
+	}
+
+	return -ENOENT;
+}
+
+static bool decoder_product(const struct lcz_lwm2m_ble_sensor_decoder *d, uint16_t product_id)
+{
+	size_t i;
+
+	if (d->product_ids == NULL) {
+		return true;
+	}
+
+	for (i = 0; i < d->product_count; i++) {
+		if (d->product_ids[i] == product_id) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Returns NULL if no decoder handles the product */
+static const struct lcz_lwm2m_ble_sensor_decoder *decoder_find(uint8_t record_type,
+							       uint16_t product_id)
+{
+	const struct lcz_lwm2m_ble_sensor_decoder *any = NULL;
+	const struct lcz_lwm2m_ble_sensor_decoder *d = lbs.decoder[record_type];
+
+	/* Most record types have one decoder */
+	if (d == NULL || !atomic_test_bit(lbs.decoder_shared, record_type)) {
+		return (d != NULL && decoder_product(d, product_id)) ? d : NULL;
+	}
+
+	STRUCT_SECTION_FOREACH (lcz_lwm2m_ble_sensor_decoder, s) {
+		if (s->decode == NULL || s->set == NULL || s->obj != d->obj ||
+		    decoder_offset(s, record_type) != lbs.decoder_offset[record_type]) {
+			continue;
+		}
+		if (s->product_ids == NULL) {
+			if (any == NULL) {
+				any = s;
+			}
+		} else if (decoder_product(s, product_id)) {
+			return s;
+		}
+	}
+
+	return any;
+}
+
+#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE)
+static int32_t decode_s16(int idx, const LczSensorAdEvent_t *p, int32_t scale)
+{
+	ARG_UNUSED(idx);
+
+	return (int32_t)((int16_t)p->data.u16) * scale;
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE) || defined(CONFIG_LCZ_LWM2M_CURRENT) ||                  \
+	defined(CONFIG_LCZ_LWM2M_PRESSURE) || defined(CONFIG_LCZ_LWM2M_FILL_LEVEL)
+/* Single precision, rounded to nearest, and saturated */
+static int32_t decode_float(int idx, const LczSensorAdEvent_t *p, int32_t scale)
+{
+	ARG_UNUSED(idx);
+	float f = p->data.f * (float)scale;
+
+	if (f != f) {
+		return 0;
+	} else if (f >= (float)INT32_MAX) {
+		return INT32_MAX;
+	} else if (f <= (float)INT32_MIN) {
+		return INT32_MIN;
+	} else if (f < 0.0f) {
+		return (int32_t)(f - 0.5f);
+	} else {
+		return (int32_t)(f + 0.5f);
+	}
+}
+#endif
+
+/* Only used when a value is written to the LwM2M engine */
+static inline double fixed_to_double(int32_t value)
+{
+	return (double)value / FIXED_SCALE;
+}
+
+#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE)
+static int set_temperature(int idx, uint16_t offset, int32_t value)
+{
+	return lcz_lwm2m_managed_temperature_set(idx, offset, fixed_to_double(value));
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_CURRENT)
+static int set_current(int idx, uint16_t offset, int32_t value)
+{
+	return lcz_lwm2m_managed_current_set(idx, offset, fixed_to_double(value));
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_PRESSURE)
+static int set_pressure(int idx, uint16_t offset, int32_t value)
+{
+	return lcz_lwm2m_managed_pressure_set(idx, offset, fixed_to_double(value));
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BATTERY)
+static int32_t decode_u16(int idx, const LczSensorAdEvent_t *p, int32_t scale)
+{
+	ARG_UNUSED(idx);
+
+	return (int32_t)p->data.u16 * scale;
+}
+
+static int32_t decode_s32(int idx, const LczSensorAdEvent_t *p, int32_t scale)
+{
+	ARG_UNUSED(idx);
+
+	return p->data.s32 * scale;
+}
+
+/* The fixed point battery voltage is in mV */
+static int set_battery(int idx, uint16_t offset, int32_t value)
+{
+	uint8_t percentage = battery_level(lbs.product_id[idx], value);
+
+	return lcz_lwm2m_managed_battery_set(idx, offset, fixed_to_double(value), percentage);
+}
+
+/* The built-in tables are sampled from the battery library curves */
+static void battery_init(void)
+{
+	k_spinlock_key_t key;
+
+	battery_curve_init(&lbs.bt510_curve, BT510_PRODUCT_ID, lbs.bt510_level,
+			   lcz_lwm2m_battery_get_level_bt510);
+	battery_curve_init(&lbs.bt610_curve, BT6XX_PRODUCT_ID, lbs.bt610_level,
+			   lcz_lwm2m_battery_get_level_bt610);
+
+	key = k_spin_lock(&lbs.battery_lock);
+	sys_slist_append(&lbs.battery_curves, &lbs.bt510_curve.node);
+	sys_slist_append(&lbs.battery_curves, &lbs.bt610_curve.node);
+	k_spin_unlock(&lbs.battery_lock, key);
+}
+
+static void battery_curve_init(struct lcz_lwm2m_ble_sensor_battery_curve *curve, int product_id,
+			       uint8_t *level, uint8_t (*get_level)(double voltage))
+{
+	size_t i;
+
+	for (i = 0; i < BATTERY_LUT_SIZE; i++) {
+		level[i] = get_level((double)(BATTERY_LUT_MIN_MV + (i * BATTERY_LUT_STEP_MV)) /
+				     1000.0);
+	}
+
+	curve->product_id = product_id;
+	curve->min_mv = BATTERY_LUT_MIN_MV;
+	curve->step_mv = BATTERY_LUT_STEP_MV;
+	curve->count = BATTERY_LUT_SIZE;
+	curve->level = level;
+}
+
+/* Returns 0 when the product doesn't have a curve */
+static uint8_t battery_level(int product_id, int32_t mv)
+{
+	struct lcz_lwm2m_ble_sensor_battery_curve *curve;
+	k_spinlock_key_t key;
+	uint8_t level = 0;
+	uint32_t i;
+
+	key = k_spin_lock(&lbs.battery_lock);
+	SYS_SLIST_FOR_EACH_CONTAINER (&lbs.battery_curves, curve, node) {
+		if (curve->product_id != product_id) {
+			continue;
+		}
+		if (mv <= curve->min_mv) {
+			i = 0;
+		} else {
+			i = MIN((uint32_t)(mv - curve->min_mv) / curve->step_mv, curve->count - 1U);
+		}
+		level = curve->level[i];
+		break;
+	}
+	k_spin_unlock(&lbs.battery_lock, key);
+
+	return level;
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_FILL_LEVEL)
+static int set_fill_level(int idx, uint16_t offset, int32_t value)
+{
+	return lcz_lwm2m_managed_fill_level_set(idx, offset, fixed_to_double(value));
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEADBAND)
+/* Returns true if the value should be reported.
+ * A bypassed value is always reported and becomes the reference value.
+ */
+static bool deadband_check(const struct obj_update *u, bool bypass)
+{
+	const struct deadband_config *cfg = &deadband_config[u->obj];
+	struct deadband_state *state = &lbs.deadband[u->idx][u->channel];
+	uint32_t now = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+	uint32_t elapsed = now - state->time;
+	uint32_t delta;
+
+	if (state->valid && !bypass) {
+		if (elapsed < cfg->min_interval) {
+			return false;
+		}
+
+		/* The difference of two int32_t always fits in a uint32_t */
+		if (u->value > state->value) {
+			delta = (uint32_t)u->value - (uint32_t)state->value;
+		} else {
+			delta = (uint32_t)state->value - (uint32_t)u->value;
+		}
+
+		/* An unchanged value is never reported before max silence */
+		if ((delta == 0 || delta < cfg->delta) &&
+		    (cfg->max_silence == 0 || elapsed < cfg->max_silence)) {
+			return false;
+		}
+	}
+
+	state->value = u->value;
+	state->time = now;
+	state->valid = true;
+	return true;
+}
+#else
+/* Returns true if the value differs from the last value of the channel, so the
+ * conversion and write are skipped for repeated readings.
+ * A bypassed value is always reported.
+ */
+static bool value_changed(const struct obj_update *u, bool bypass)
+{
+	if (!bypass && (lbs.value_valid[u->idx] & BIT(u->channel)) != 0 &&
+	    lbs.last_value[u->idx][u->channel] == u->value) {
+		return false;
+	}
+
+	lbs.last_value[u->idx][u->channel] = u->value;
+	lbs.value_valid[u->idx] |= BIT(u->channel);
+	return true;
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SIGNAL)
+/* Occurs in BT RX thread context.
+ * Each average moves 1/8th of the way to the new value.
+ */
+static void signal_update(int idx, int8_t rssi)
+{
+	uint32_t now = k_uptime_get_32();
+	k_spinlock_key_t key;
+	uint32_t gap;
+	int32_t delta;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE)
+	uint32_t missed;
+#endif
+
+	key = k_spin_lock(&lbs.signal_lock);
+	gap = now - lbs.ad_last[idx];
+	if (lbs.ad_count[idx] == 0) {
+		lbs.rssi_avg[idx] = rssi * 16;
+		lbs.ad_interval[idx] = 0;
+	} else {
+		lbs.rssi_avg[idx] += (rssi * 16 - lbs.rssi_avg[idx]) / 8;
+		if (lbs.ad_count[idx] == 1) {
+			lbs.ad_interval[idx] = gap;
+		} else {
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE)
+			/* Ads missed between scan windows don't stretch the period,
+			 * but a gap that isn't a multiple of the period changes it.
+			 */
+			if (lbs.ad_interval[idx] > 0 &&
+			    gap > lbs.ad_interval[idx] + (lbs.ad_interval[idx] / 2)) {
+				missed = (gap + (lbs.ad_interval[idx] / 2)) / lbs.ad_interval[idx];
+				delta = (int32_t)(gap - (missed * lbs.ad_interval[idx]));
+				if (delta >= -SCAN_GUARD_MS && delta <= SCAN_GUARD_MS) {
+					gap /= missed;
+				}
+			}
+#endif
+			delta = (int32_t)gap - (int32_t)lbs.ad_interval[idx];
+			lbs.ad_interval[idx] += delta / 8;
+		}
+	}
+
+	lbs.rssi_last[idx] = rssi;
+	lbs.ad_last[idx] = now;
+	lbs.ad_count[idx] += 1;
+	k_spin_unlock(&lbs.signal_lock, key);
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT)
+/* Occurs in BT RX thread context.
+ * Only devices whose ads have been indexed by this module can be removed.
+ * The gateway object removes the device when its lifetime expires,
+ * and the next ad from a new device is then able to create it.
+ */
+static void evict(int8_t rssi)
+{
+	uint32_t now = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+	k_spinlock_key_t key;
+	atomic_val_t last;
+	int victim = -1;
+	int idx;
+	int r;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT_WEAKEST)
+	/* 1/16 dBm, the same as the averages */
+	int32_t weaker = (rssi - CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT_RSSI_MARGIN) * 16;
+	k_spinlock_key_t signal_key;
+#endif
+
+	/* Limit the rate of removal so that devices don't replace each other in turn.
+	 * A search that doesn't find a device also waits, so that each ad from a new device
+	 * doesn't scan the table.
+	 */
+	last = atomic_get(&lbs.evict_time);
+	if (last != 0 &&
+	    (now + 1 - (uint32_t)last) < CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT_INTERVAL_SECONDS) {
+		return;
+	}
+	/* Another thread started a search */
+	if (!atomic_cas(&lbs.evict_time, last, (atomic_val_t)(now + 1))) {
+		return;
+	}
+
+	key = k_spin_lock(&lbs.addr_index_lock);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT_WEAKEST)
+	signal_key = k_spin_lock(&lbs.signal_lock);
+#endif
+	for (idx = 0; idx < MAX_INSTANCES; idx++) {
+		if (!lbs.addr_indexed[idx] || atomic_test_bit(lbs.evicting, idx)) {
+			continue;
+		}
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT_LRU)
+		ARG_UNUSED(rssi);
+		/* A device that hasn't been seen doesn't have an idle time */
+		if (lbs.last_seen[idx] == 0 ||
+		    (now - lbs.last_seen[idx]) <
+			    CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT_MIN_IDLE_SECONDS) {
+			continue;
+		}
+		if (victim < 0 || (now - lbs.last_seen[idx]) > (now - lbs.last_seen[victim])) {
+			victim = idx;
+		}
+#else
+		if (lbs.ad_count[idx] == 0 || lbs.rssi_avg[idx] > weaker) {
+			continue;
+		}
+		if (victim < 0 || lbs.rssi_avg[idx] < lbs.rssi_avg[victim]) {
+			victim = idx;
+		}
+#endif
+	}
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT_WEAKEST)
+	k_spin_unlock(&lbs.signal_lock, signal_key);
+#endif
+	k_spin_unlock(&lbs.addr_index_lock, key);
+
+	if (victim < 0) {
+		return;
+	}
+
+	r = lcz_lwm2m_gw_obj_set_lifetime(victim, EVICT_LIFETIME);
+	if (r < 0) {
+		LOG_ERR("Unable to evict idx: %d: %d", victim, r);
+		return;
+	}
+
+	atomic_set_bit(lbs.evicting, victim);
+	lbs.lifetime_valid[victim] = false;
+	INCR_STAT(EVICTIONS);
+	LOG_INF("Evicting idx: %d", victim);
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SAMPLES)
+/* The sample lock must be held */
+static struct sample_ring *sample_ring_find(int idx, uint8_t channel)
+{
+	struct sample_ring *ring;
+
+	SYS_SLIST_FOR_EACH_CONTAINER (&lbs.sample_rings[idx], ring, node) {
+		if (ring->channel == channel) {
+			return ring;
+		}
+	}
+
+	return NULL;
+}
+
+/* The oldest sample is overwritten when the ring is full */
+static void sample_add(const struct obj_update *u)
+{
+	struct lcz_lwm2m_ble_sensor_sample *sample;
+	struct sample_ring *ring;
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&lbs.sample_lock);
+	ring = sample_ring_find(u->idx, u->channel);
+	if (ring == NULL) {
+		if (k_mem_slab_alloc(&lbs_sample_slab, (void **)&ring, K_NO_WAIT) != 0) {
+			k_spin_unlock(&lbs.sample_lock, key);
+			INCR_STAT(SAMPLE_DROPS);
+			return;
+		}
+		ring->channel = u->channel;
+		ring->head = 0;
+		ring->count = 0;
+		sys_slist_append(&lbs.sample_rings[u->idx], &ring->node);
+	}
+
+	sample = &ring->samples[(ring->head + ring->count) % SAMPLE_RING_SIZE];
+	if (ring->count < SAMPLE_RING_SIZE) {
+		ring->count += 1;
+	} else {
+		ring->head = (ring->head + 1) % SAMPLE_RING_SIZE;
+	}
+	sample->timestamp = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+	sample->value = u->value;
+	k_spin_unlock(&lbs.sample_lock, key);
+}
+
+static void sample_free(int idx)
+{
+	k_spinlock_key_t key;
+	sys_snode_t *node;
+
+	key = k_spin_lock(&lbs.sample_lock);
+	while ((node = sys_slist_get(&lbs.sample_rings[idx])) != NULL) {
+		k_mem_slab_free(&lbs_sample_slab, (void **)&node);
+	}
+	k_spin_unlock(&lbs.sample_lock, key);
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH)
+/* Merge the update with a pending update of the same resource; the latest value wins */
+static void batch_add(const struct obj_update *u)
+{
+	struct ingest *in = ingest_of(u->idx);
+	struct batch_entry *e = NULL;
+	size_t i;
+
+	for (i = 0; i < in->batch_count; i++) {
+		if (in->batch[i].u.idx == u->idx && in->batch[i].u.obj == u->obj &&
+		    in->batch[i].u.offset == u->offset) {
+			e = &in->batch[i];
+			INCR_STAT(BATCH_MERGES);
+			break;
+		}
+	}
+
+	if (e == NULL) {
+		e = &in->batch[in->batch_count++];
+	}
+
+	memcpy(&e->u, u, sizeof(e->u));
+	e->gen = lbs.gen[u->idx];
+
+	if (in->batch_count >= ARRAY_SIZE(in->batch)) {
+		batch_flush(in);
+	} else if (CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH_WINDOW_MS > 0) {
+		/* The window starts with the first pending update */
+		k_work_schedule_for_queue(&in->workq, &in->batch_work,
+					  K_MSEC(CONFIG_LCZ_LWM2M_BLE_SENSOR_BATCH_WINDOW_MS));
+	}
+}
+
+static void batch_remove(const struct obj_update *u)
+{
+	struct ingest *in = ingest_of(u->idx);
+	size_t i;
+
+	for (i = 0; i < in->batch_count; i++) {
+		if (in->batch[i].u.idx == u->idx && in->batch[i].u.obj == u->obj &&
+		    in->batch[i].u.offset == u->offset) {
+			in->batch_count -= 1;
+			memcpy(&in->batch[i], &in->batch[in->batch_count], sizeof(in->batch[i]));
+			break;
+		}
+	}
+}
+
+/* Updates are only batched by the ingest instance that processes the device */
+static void batch_flush(struct ingest *in)
+{
+	uint32_t start;
+	size_t i;
+
+	start = timing_start();
+	for (i = 0; i < in->batch_count; i++) {
+		/* Skip updates for a device that was removed while the update was pending */
+		if (in->batch[i].gen != lbs.gen[in->batch[i].u.idx]) {
+			continue;
+		}
+		if (obj_set(&in->batch[i].u) == 0) {
+			INCR_STAT(SET_EVENTS);
+		} else {
+			INCR_STAT(SET_ERRORS);
+		}
+	}
+
+	in->batch_count = 0;
+	k_work_cancel_delayable(&in->batch_work);
+	timing_stop(LCZ_LWM2M_BLE_SENSOR_STAGE_FLUSH, start);
+}
+
+/* Occurs in sensor work queue context */
+static void batch_work_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+
+	batch_flush(CONTAINER_OF(dwork, struct ingest, batch_work));
+}
+#endif
+
+/**
+ * @brief The scan response is used to determine the sensor type.
+ * Which is used to determine the battery conversion.
+ */
+static int rsp_handler(const bt_addr_le_t *addr, LczSensorRsp_t *p)
+{
+	unsigned int key;
+	int idx = -EPERM;
+
+	if (p == NULL) {
+		return idx;
+	}
+
+	idx = get_index(addr, false);
+	if (idx >= 0 && lbs.product_id[idx] != p->productId) {
+		/* Saved with the last event of the device */
+		key = event_write_begin(idx);
+		lbs.product_id[idx] = p->productId;
+		event_write_end(idx, key);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+		persist_changed();
+#endif
+	}
+	return idx;
+}
+
+static void name_handler(int idx, const AdHandle_t *name)
+{
+	uint32_t hash;
+	int r;
+
+	if (!valid_index(idx)) {
+		return;
+	}
+
+	if (atomic_test_bit(lbs.name_settled, idx)) {
+		return;
+	}
+
+	if (name->pPayload == NULL) {
+		return;
+	}
+
+	/* Nothing to do if the name hasn't changed since it was handled */
+	hash = fnv1a(name->pPayload, name->size);
+	if (atomic_test_bit(lbs.name_hashed, idx) && lbs.name_hash[idx] == hash) {
+		atomic_set_bit(lbs.name_settled, idx);
+		return;
+	}
+
+	/* If the LwM2M connection has been proxied or named already, then don't try to set name. */
+	if (lcz_lwm2m_gw_obj_inst_created(idx)) {
+		name_settle(idx, hash);
+		return;
+	}
+
+	r = lcz_lwm2m_gw_obj_set_endpoint_name(idx, name->pPayload, name->size);
+	if (r == 0) {
+		INCR_STAT(NAME_UPDATES);
+		name_settle(idx, hash);
+	}
+	LOG_DBG("Set endpoint name in database[%d]: %d", idx, r);
+}
+
+static uint32_t fnv1a(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 16777619U;
+	}
+
+	return h;
+}
+
+static void name_settle(int idx, uint32_t hash)
+{
+	lbs.name_hash[idx] = hash;
+	atomic_set_bit(lbs.name_hashed, idx);
+	atomic_set_bit(lbs.name_settled, idx);
+}
+
+/* Occurs in system work queue context.
+ * Periodically search for names again so that a rename is detected.
+ */
+static void name_work_handler(struct k_work *work)
+{
+	size_t i;
+
+	ARG_UNUSED(work);
+
+	for (i = 0; i < ARRAY_SIZE(lbs.name_settled); i++) {
+		atomic_clear(&lbs.name_settled[i]);
+	}
+
+	k_work_schedule(&lbs.name_work,
+			K_SECONDS(CONFIG_LCZ_LWM2M_BLE_SENSOR_NAME_RECHECK_SECONDS));
+}
+
+static int gw_obj_removed(int idx, void *context)
+{
+	unsigned int key;
+
+	ARG_UNUSED(context);
+
+	if (valid_index(idx)) {
+		addr_index_remove(idx);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEDUP_CACHE)
+		atomic_set(&lbs.dedup_flush, 1);
+#endif
+		atomic_set(&lbs.table_full, 0);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE)
+		/* Devices that were rejected because the table was full can now be added */
+		reject_clear();
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ACCEPT_LIST)
+		k_work_submit(&lbs.accept_list_work);
+#endif
+		lbs.lifetime_valid[idx] = false;
+		key = event_write_begin(idx);
+		lbs.product_id[idx] = (uint16_t)INVALID_PRODUCT_ID;
+		lbs.last_event[idx] = EVENT_KEY_NONE;
+		lbs.channel_valid[idx] = 0;
+		event_write_end(idx, key);
+		atomic_clear_bit(lbs.name_settled, idx);
+		atomic_clear_bit(lbs.name_hashed, idx);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SIGNAL)
+		key = k_spin_lock(&lbs.signal_lock);
+		lbs.ad_count[idx] = 0;
+		k_spin_unlock(&lbs.signal_lock, key);
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_EVICT)
+		atomic_clear_bit(lbs.evicting, idx);
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEFERRED)
+		lbs.gen[idx] += 1;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_DEADBAND)
+		memset(lbs.deadband[idx], 0, sizeof(lbs.deadband[idx]));
+#else
+		lbs.value_valid[idx] = 0;
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SAMPLES)
+		sample_free(idx);
+#endif
+	}
+
+	return 0;
+}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST)
+/* Only the first load is used; later loads would restore stale state */
+static int persist_settings_set(const char *name, size_t len, settings_read_cb read_cb,
+				void *cb_arg)
+{
+	k_spinlock_key_t key;
+	const char *next;
+	bool loaded;
+	ssize_t r;
+
+	if (!settings_name_steq(name, PERSIST_KEY, &next) || next != NULL) {
+		return -ENOENT;
+	}
+
+	key = k_spin_lock(&lbs.persist_lock);
+	loaded = lbs.restore_loaded;
+	lbs.restore_loaded = true;
+	k_spin_unlock(&lbs.persist_lock, key);
+	if (loaded) {
+		return 0;
+	}
+
+	/* The records aren't used until the count is set */
+	r = read_cb(cb_arg, lbs.restore, MIN(len, sizeof(lbs.restore)));
+
+	key = k_spin_lock(&lbs.persist_lock);
+	if (r < 0) {
+		lbs.restore_loaded = false;
+	} else {
+		lbs.restore_count = (size_t)r / sizeof(lbs.restore[0]);
+	}
+	k_spin_unlock(&lbs.persist_lock, key);
+	if (r < 0) {
+		return (int)r;
+	}
+
+	LOG_INF("Loaded state of %zu devices", lbs.restore_count);
+	return 0;
+}
+
+/* Apply the saved state of a device when it is added to the local index */
+static void persist_restore(int idx, const bt_addr_le_t *addr)
+{
+	unsigned int event_key;
+	k_spinlock_key_t key;
+	size_t i;
+
+	key = k_spin_lock(&lbs.persist_lock);
+	for (i = 0; i < lbs.restore_count; i++) {
+		if (bt_addr_le_cmp(&lbs.restore[i].addr, addr) == 0) {
+			event_key = event_write_begin(idx);
+			lbs.product_id[idx] = lbs.restore[i].product_id;
+			lbs.last_event[idx] = lbs.restore[i].last_event;
+			event_write_end(idx, event_key);
+			lbs.restore_count -= 1;
+			memcpy(&lbs.restore[i], &lbs.restore[lbs.restore_count],
+			       sizeof(lbs.restore[i]));
+			break;
+		}
+	}
+	k_spin_unlock(&lbs.persist_lock, key);
+}
+
+/* Changes are written in one batch to limit flash wear */
+static void persist_changed(void)
+{
+	if (!atomic_set(&lbs.persist_dirty, 1)) {
+		k_work_schedule(&lbs.persist_work,
+				K_SECONDS(CONFIG_LCZ_LWM2M_BLE_SENSOR_PERSIST_DELAY_SECONDS));
+	}
+}
+
+/* Occurs in system work queue context */
+static void persist_work_handler(struct k_work *work)
+{
+	static struct persist_record records[MAX_INSTANCES];
+	k_spinlock_key_t key;
+	atomic_val_t seq;
+	size_t count = 0;
+	bool stable;
+	size_t i;
+	int idx;
+	int r;
+
+	ARG_UNUSED(work);
+
+	atomic_clear(&lbs.persist_dirty);
+
+	for (idx = 0; idx < MAX_INSTANCES; idx++) {
+		key = k_spin_lock(&lbs.addr_index_lock);
+		if (lbs.addr_indexed[idx]) {
+			bt_addr_le_copy(&records[count].addr, &lbs.addr[idx]);
+			/* The event fields are written without the index lock */
+			do {
+				stable = event_read_begin(idx, &seq);
+				records[count].product_id = lbs.product_id[idx];
+				records[count].last_event = lbs.last_event[idx];
+			} while (!stable || event_read_retry(idx, seq));
+			count += 1;
+		}
+		k_spin_unlock(&lbs.addr_index_lock, key);
+	}
+
+	/* A device that hasn't been heard from for a lifetime has been removed from the table */
+	key = k_spin_lock(&lbs.persist_lock);
+	if (k_uptime_get() > (LIFETIME * MSEC_PER_SEC)) {
+		lbs.restore_count = 0;
+	}
+	for (i = 0; i < lbs.restore_count && count < MAX_INSTANCES; i++) {
+		memcpy(&records[count++], &lbs.restore[i], sizeof(records[0]));
+	}
+	k_spin_unlock(&lbs.persist_lock, key);
+
+	r = settings_save_one(PERSIST_SUBTREE "/" PERSIST_KEY, records, count * sizeof(records[0]));
+	if (r < 0) {
+		LOG_ERR("Unable to save device state: %d", r);
+	} else {
+		LOG_DBG("Saved state of %zu devices", count);
+	}
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ADAPTIVE_SCAN) ||                                         \
+	defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ACCEPT_LIST)
+/* The scan module only uses new parameters when scanning is (re)started */
+static void scan_restart(void)
+{
+	int r;
+
+	r = lcz_bt_scan_update_parameters(lbs.scan_user_id, &scan_parameters);
+	if (r < 0) {
+		LOG_ERR("Unable to update scan parameters: %d", r);
+		return;
+	}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE)
+	/* Outside of a window, the parameters are used when the next window starts */
+	if (lbs.scan_scheduled && !lbs.scan_window) {
+		return;
+	}
+#endif
+
+	r = lcz_bt_scan_stop(lbs.scan_user_id);
+	if (r < 0) {
+		LOG_ERR("Unable to stop scanning: %d", r);
+	}
+	r = lcz_bt_scan_start(lbs.scan_user_id);
+	if (r < 0) {
+		LOG_ERR("Unable to start scanning: %d", r);
+	}
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ACCEPT_LIST)
+/* Load the addresses of all devices in the gateway table.
+ * Fails if a device isn't in the local index or the controller's list is too small.
+ */
+static int accept_list_load(void)
+{
+	k_spinlock_key_t key;
+	bt_addr_le_t addr;
+	bool indexed;
+	int idx;
+	int r;
+
+	r = bt_le_filter_accept_list_clear();
+	for (idx = 0; idx < MAX_INSTANCES && r == 0; idx++) {
+		key = k_spin_lock(&lbs.addr_index_lock);
+		indexed = lbs.addr_indexed[idx];
+		bt_addr_le_copy(&addr, &lbs.addr[idx]);
+		k_spin_unlock(&lbs.addr_index_lock, key);
+
+		if (!indexed) {
+			r = -ENOENT;
+		} else {
+			r = bt_le_filter_accept_list_add(&addr);
+		}
+	}
+
+	return r;
+}
+
+/* Only scan for known devices while the table is full */
+static void accept_list_work_handler(struct k_work *work)
+{
+	bool full = (atomic_get(&lbs.table_full) != 0);
+	int r;
+
+	ARG_UNUSED(work);
+
+	if (full == lbs.accept_list_active) {
+		return;
+	}
+
+	/* The accept list can't be changed while the scanner is using it */
+	r = lcz_bt_scan_stop(lbs.scan_user_id);
+	if (r < 0) {
+		LOG_ERR("Unable to stop scanning: %d", r);
+	}
+
+	if (full) {
+		r = accept_list_load();
+		if (r == 0) {
+			scan_parameters.options |= BT_LE_SCAN_OPT_FILTER_ACCEPT_LIST;
+		} else {
+			LOG_WRN("Unable to load accept list: %d", r);
+		}
+	} else {
+		scan_parameters.options &= ~BT_LE_SCAN_OPT_FILTER_ACCEPT_LIST;
+	}
+	lbs.accept_list_active =
+		((scan_parameters.options & BT_LE_SCAN_OPT_FILTER_ACCEPT_LIST) != 0);
+	LOG_INF("Accept list %s", lbs.accept_list_active ? "enabled" : "disabled");
+
+	scan_restart();
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_ADAPTIVE_SCAN)
+static void scan_set_parameters(bool steady)
+{
+	if (steady) {
+		scan_parameters.interval = CONFIG_LCZ_LWM2M_BLE_SENSOR_STEADY_SCAN_INTERVAL;
+		scan_parameters.window = CONFIG_LCZ_LWM2M_BLE_SENSOR_STEADY_SCAN_WINDOW;
+	} else {
+		scan_parameters.interval = CONFIG_LCZ_LWM2M_BLE_SENSOR_DISCOVERY_SCAN_INTERVAL;
+		scan_parameters.window = CONFIG_LCZ_LWM2M_BLE_SENSOR_DISCOVERY_SCAN_WINDOW;
+	}
+	lbs.scan_steady = steady;
+}
+
+static void scan_apply(bool steady)
+{
+	scan_set_parameters(steady);
+	scan_restart();
+}
+
+/* Returns true if every device in the local index has been heard from recently */
+static bool scan_all_reporting(void)
+{
+	uint32_t now = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+	k_spinlock_key_t key;
+	bool reporting = true;
+	int idx;
+
+	key = k_spin_lock(&lbs.addr_index_lock);
+	for (idx = 0; idx < MAX_INSTANCES && reporting; idx++) {
+		if (lbs.addr_indexed[idx] &&
+		    (now - lbs.last_seen[idx]) > CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_REPORT_SECONDS) {
+			reporting = false;
+		}
+	}
+	k_spin_unlock(&lbs.addr_index_lock, key);
+
+	return reporting;
+}
+
+static void scan_work_handler(struct k_work *work)
+{
+	uint32_t creates = (uint32_t)atomic_get(&lbs.stats[LCZ_LWM2M_BLE_SENSOR_STAT_CREATES]);
+	uint32_t accepted =
+		(uint32_t)atomic_get(&lbs.stats[LCZ_LWM2M_BLE_SENSOR_STAT_ACCEPTED_ADS]);
+	bool discovering;
+	bool steady;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE)
+	uint32_t now = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+#endif
+
+	ARG_UNUSED(work);
+
+	/* Discovery continues until no new devices have been added for a while */
+	if (creates != lbs.scan_creates) {
+		lbs.scan_quiet_periods = 0;
+	} else if (lbs.scan_quiet_periods < CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_QUIET_PERIODS) {
+		lbs.scan_quiet_periods += 1;
+	}
+	discovering = !atomic_get(&lbs.table_full) &&
+		      lbs.scan_quiet_periods < CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_QUIET_PERIODS;
+
+	steady = !discovering && scan_all_reporting();
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE)
+	/* Devices that start advertising while scanning is off are found by periodically
+	 * scanning with the discovery parameters for one evaluation period.
+	 */
+	if (!steady) {
+		lbs.scan_continuous = now;
+	} else if ((now - lbs.scan_continuous) >=
+		   CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE_DISCOVERY_SECONDS) {
+		lbs.scan_continuous = now;
+		steady = false;
+	}
+	/* Scanning is restarted with the new parameters after it is continuous */
+	scan_schedule_set(steady && scan_all_tracked());
+#endif
+
+	if (steady != lbs.scan_steady) {
+		LOG_INF("%s scan: %u new devices, %u accepted ads/s",
+			steady ? "Steady" : "Discovery", creates - lbs.scan_creates,
+			(accepted - lbs.scan_accepted) /
+				CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_EVAL_SECONDS);
+		scan_apply(steady);
+	}
+
+	lbs.scan_creates = creates;
+	lbs.scan_accepted = accepted;
+
+	k_work_schedule(&lbs.scan_work, K_SECONDS(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_EVAL_SECONDS));
+}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_SCHEDULE)
+/* Returns true if the advertising period of every device in the local index is known
+ * and long enough for scan windows.
+ */
+static bool scan_all_tracked(void)
+{
+	k_spinlock_key_t signal_key;
+	k_spinlock_key_t key;
+	bool tracked = true;
+	int count = 0;
+	int idx;
+
+	key = k_spin_lock(&lbs.addr_index_lock);
+	signal_key = k_spin_lock(&lbs.signal_lock);
+	for (idx = 0; idx < MAX_INSTANCES && tracked; idx++) {
+		if (!lbs.addr_indexed[idx]) {
+			continue;
+		}
+		if (lbs.ad_count[idx] < 2 || lbs.ad_interval[idx] <= SCAN_MIN_PERIOD_MS) {
+			tracked = false;
+		}
+		count += 1;
+	}
+	k_spin_unlock(&lbs.signal_lock, signal_key);
+	k_spin_unlock(&lbs.addr_index_lock, key);
+
+	return (tracked && count > 0);
+}
+
+static void scan_schedule_set(bool scheduled)
+{
+	int r;
+
+	if (scheduled == lbs.scan_scheduled) {
+		return;
+	}
+
+	lbs.scan_scheduled = scheduled;
+	LOG_INF("Scan windows %s", scheduled ? "enabled" : "disabled");
+	if (scheduled) {
+		/* Scanning is on until the first window is evaluated */
+		lbs.scan_window = true;
+		k_work_schedule(&lbs.scan_window_work, K_NO_WAIT);
+		return;
+	}
+
+	k_work_cancel_delayable(&lbs.scan_window_work);
+	if (!lbs.scan_window) {
+		r = lcz_bt_scan_start(lbs.scan_user_id);
+		if (r < 0) {
+			LOG_ERR("Unable to start scanning: %d", r);
+		}
+		lbs.scan_window = true;
+	}
+}
+
+/* Scanning is on while any device is within the guard time of its next expected ad */
+static void scan_window_work_handler(struct k_work *work)
+{
+	uint32_t next = CONFIG_LCZ_LWM2M_BLE_SENSOR_SCAN_EVAL_SECONDS * MSEC_PER_SEC;
+	uint32_t guard = SCAN_GUARD_MS;
+	uint32_t now = k_uptime_get_32();
+	uint32_t interval;
+	uint32_t elapsed;
+	int32_t arrival;
+	k_spinlock_key_t signal_key;
+	k_spinlock_key_t key;
+	bool due = false;
+	int idx;
+	int r;
+
+	ARG_UNUSED(work);
+
+	key = k_spin_lock(&lbs.addr_index_lock);
+	signal_key = k_spin_lock(&lbs.signal_lock);
+	for (idx = 0; idx < MAX_INSTANCES; idx++) {
+		interval = lbs.ad_interval[idx];
+		if (!lbs.addr_indexed[idx] || interval == 0) {
+			continue;
+		}
+		/* The period dropped since the schedule was enabled */
+		if (interval <= SCAN_MIN_PERIOD_MS) {
+			due = true;
+			continue;
+		}
+
+		/* Time from now until the first expected ad whose window hasn't ended.
+		 * It is negative when the ad is late, but more than -guard.
+		 */
+		elapsed = now - lbs.ad_last[idx];
+		if (elapsed < guard) {
+			arrival = (int32_t)interval - (int32_t)elapsed;
+		} else {
+			arrival = (int32_t)(interval - ((elapsed - guard) % interval)) -
+				  (int32_t)guard;
+		}
+
+		if (arrival <= (int32_t)guard) {
+			due = true;
+			next = MIN(next, (uint32_t)(arrival + (int32_t)guard));
+		} else {
+			next = MIN(next, (uint32_t)(arrival - (int32_t)guard));
+		}
+	}
+	k_spin_unlock(&lbs.signal_lock, signal_key);
+	k_spin_unlock(&lbs.addr_index_lock, key);
+
+	if (due != lbs.scan_window) {
+		if (due) {
+			INCR_STAT(SCAN_WINDOWS);
+			r = lcz_bt_scan_start(lbs.scan_user_id);
+		} else {
+			r = lcz_bt_scan_stop(lbs.scan_user_id);
+		}
+		if (r < 0) {
+			LOG_ERR("Unable to %s scanning: %d", due ? "start" : "stop", r);
+		}
+		lbs.scan_window = due;
+	}
+
+	k_work_schedule(&lbs.scan_window_work, K_MSEC(MAX(next, 1)));
+}
+#endif
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE)
+/* Offsets are relative to the oldest record */
+static void capture_copy_in(size_t offset, const void *src, size_t len)
+{
+	size_t pos = (lbs.capture_head + offset) % CAPTURE_SIZE;
+	size_t first = MIN(len, CAPTURE_SIZE - pos);
+
+	memcpy(&lbs.capture[pos], src, first);
+	memcpy(lbs.capture, (const uint8_t *)src + first, len - first);
+}
+
+static void capture_copy_out(size_t offset, void *dst, size_t len)
+{
+	size_t pos = (lbs.capture_head + offset) % CAPTURE_SIZE;
+	size_t first = MIN(len, CAPTURE_SIZE - pos);
+
+	memcpy(dst, &lbs.capture[pos], first);
+	memcpy((uint8_t *)dst + first, lbs.capture, len - first);
+}
+
+/* Wait for the live ad that the BT RX thread may be processing.
+ * Live ads that start after replay_busy is set are dropped, so the count only drops.
+ */
+static int replay_begin(void)
+{
+	if (atomic_set(&lbs.replay_busy, 1)) {
+		return -EBUSY;
+	}
+
+	k_sem_reset(&lbs.rx_idle);
+	if (atomic_get(&lbs.rx_active) != 0) {
+		k_sem_take(&lbs.rx_idle, K_FOREVER);
+	}
 
-static void name_handler(int idx, struct net_buf_simple *ad);
-static int rsp_handler(const bt_addr_le_t *addr, LczSensorRsp_t *p);
+	return 0;
+}
 
-static int gw_obj_removed(int idx, void *context);
+/* Speed 0 replays without delay, 1 at the original rate, and n at n times the original rate */
+static void replay_delay(uint32_t *prev, uint32_t timestamp, uint32_t speed)
+{
+	if (speed != 0 && *prev != 0 && timestamp > *prev) {
+		k_sleep(K_MSEC((timestamp - *prev) / speed));
+	}
+	*prev = timestamp;
+}
 
-#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_LOG_LEVEL_DBG)
-static const char *get_name(int idx);
+static void replay_record(const struct lcz_lwm2m_ble_sensor_capture_record *record,
+			  const uint8_t *data)
+{
+	struct net_buf_simple ad;
+	bt_addr_le_t addr;
+
+	/* The scanner provides a writable buffer */
+	net_buf_simple_init_with_data(&ad, (uint8_t *)data, record->len);
+	bt_addr_le_copy(&addr, &record->addr);
+	ad_handler(&addr, record->rssi, record->type, &ad);
+}
 #endif
 
-/**************************************************************************************************/
-/* SYS INIT                                                                                       */
-/**************************************************************************************************/
-static int lcz_lwm2m_ble_sensor_init(const struct device *dev)
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_LOG_LEVEL_DBG)
+/* The caller owns the buffer so that this can be used from more than one thread */
+static const char *get_name(int idx, char *name, size_t size)
 {
-	ARG_UNUSED(dev);
-	int idx;
 	int r;
 
-	for (idx = 0; idx < MAX_INSTANCES; idx++) {
-		lbs.table[idx].product_id = INVALID_PRODUCT_ID;
+	memset(name, 0, size);
+	r = lcz_lwm2m_gw_obj_get_endpoint_name(idx, name, size - 1);
+	if (r < 0) {
+		return "?";
+	} else {
+		return name;
 	}
+}
+#endif
 
-	if (!lcz_bt_scan_register(&lbs.scan_user_id, ad_handler)) {
-		LOG_ERR("LWM2M sensor module failed to register with scan module");
-	}
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_TIMING)
+static inline uint32_t timing_start(void)
+{
+	return k_cycle_get_32();
+}
 
-	r = lcz_bt_scan_update_parameters(lbs.scan_user_id, &scan_parameters);
-	if (r < 0) {
-		LOG_ERR("Unable to update scan parameters: %d", r);
+static inline void timing_stop(enum lcz_lwm2m_ble_sensor_stage stage, uint32_t start)
+{
+	struct lcz_lwm2m_ble_sensor_timing *t = &lbs.timing[stage];
+	uint32_t cycles = k_cycle_get_32() - start;
+	k_spinlock_key_t key;
+	size_t bucket;
+
+	/* Bucket n holds [2^n, 2^(n+1)) cycles */
+	bucket = (cycles <= 1) ? 0 : (31 - __builtin_clz(cycles));
+	bucket = MIN(bucket, LCZ_LWM2M_BLE_SENSOR_TIMING_BUCKETS - 1);
+
+	key = k_spin_lock(&lbs.timing_lock);
+	if (t->count == 0 || cycles < t->min) {
+		t->min = cycles;
 	}
-	r = lcz_bt_scan_start(lbs.scan_user_id);
-	if (r < 0) {
-		LOG_ERR("Unable to start scanning: %d", r);
+	if (cycles > t->max) {
+		t->max = cycles;
 	}
-
-	lbs.agent.gw_obj_deleted = gw_obj_removed;
-	lcz_lwm2m_util_register_agent(&lbs.agent);
-
+	t->count += 1;
+	t->total += cycles;
+	t->histogram[bucket] += 1;
+	k_spin_unlock(&lbs.timing_lock, key);
+}
+#else
+static inline uint32_t timing_start(void)
+{
 	return 0;
 }
 
-SYS_INIT(lcz_lwm2m_ble_sensor_init, APPLICATION, LCZ_LWM2M_UTIL_USER_INIT_PRIORITY);
+static inline void timing_stop(enum lcz_lwm2m_ble_sensor_stage stage, uint32_t start)
+{
+	ARG_UNUSED(stage);
+	ARG_UNUSED(start);
+}
+#endif
 
 /**************************************************************************************************/
-/* Occurs in BT RX Thread context                                                                 */
+/* Global Function Definitions                                                                    */
 /**************************************************************************************************/
-static void ad_handler(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
-		       struct net_buf_simple *ad)
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_BENCHMARK)
+void lcz_lwm2m_ble_sensor_ad_inject(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+				    struct net_buf_simple *ad)
+{
+	ad_handler(addr, rssi, type, ad);
+}
+
+void lcz_lwm2m_ble_sensor_bench_reset(void)
 {
 	int idx;
-	LczSensorAdCoded_t *coded;
-	AdHandle_t handle;
 
-	INCR_STAT(ads);
-	handle = AdFind_Type(ad->data, ad->len, BT_DATA_MANUFACTURER_DATA, BT_DATA_INVALID);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CREATE_QUEUE)
+	k_spinlock_key_t key;
 
-	/* Only one of these types can occur at a time.
-	 * The are ordered by probability of occurrence.
-	 */
-	if (lcz_sensor_adv_match_1m(&handle)) {
-		ad_filter(addr, (LczSensorAdEvent_t *)handle.pPayload, rssi);
-		INCR_STAT(legacy_ads);
-		return;
-	}
+	key = k_spin_lock(&lbs.create_lock);
+	lbs.create_count = 0;
+	k_spin_unlock(&lbs.create_lock, key);
+#endif
 
-	if (lcz_sensor_adv_match_coded(&handle)) {
-		INCR_STAT(coded_ads);
-		/* The coded phy contains the TLVs of the 1M ad and scan response */
-		coded = (LczSensorAdCoded_t *)handle.pPayload;
-		ad_filter(addr, &coded->ad, rssi);
-		idx = rsp_handler(addr, &coded->rsp);
-		name_handler(idx, ad);
-		return;
+	/* The benchmark's gateway table is emptied by each run, so every device is forgotten */
+	for (idx = 0; idx < MAX_INSTANCES; idx++) {
+		gw_obj_removed(idx, NULL);
 	}
+}
+#endif
 
-	if (lcz_sensor_adv_match_rsp(&handle)) {
-		INCR_STAT(rsp_ads);
-		idx = rsp_handler(addr, &(((LczSensorRspWithHeader_t *)handle.pPayload)->rsp));
-		name_handler(idx, ad);
-		return;
-	}
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE)
+void lcz_lwm2m_ble_sensor_capture_start(void)
+{
+	atomic_set(&lbs.capture_active, 1);
 }
 
-/**************************************************************************************************/
-/* Local Function Definitions                                                                     */
-/**************************************************************************************************/
-static bool valid_index(int idx)
+void lcz_lwm2m_ble_sensor_capture_stop(void)
 {
-	return (idx >= 0 && idx < MAX_INSTANCES);
+	atomic_set(&lbs.capture_active, 0);
 }
 
-static int get_index(const bt_addr_le_t *addr, bool add)
+void lcz_lwm2m_ble_sensor_capture_clear(void)
 {
-	static char addr_str[BT_ADDR_LE_STR_LEN];
-	int idx;
+	k_spinlock_key_t key = k_spin_lock(&lbs.capture_lock);
 
-	/* If the device isn't in the database,
-	 * the ad has been filtered, the table isn't full, and it isn't blocked;
-	 * try to add it.
-	 */
-	idx = lcz_lwm2m_gw_obj_lookup_ble(addr);
-	if (!valid_index(idx) && add && !lbs.table_full) {
-		bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
-		idx = lcz_lwm2m_gw_obj_create(addr);
-		/* Limit logging for blocked devices */
-		if (idx != -EPERM || IS_ENABLED(CONFIG_LCZ_LWM2M_BLE_CREATE_LOG_VERBOSE)) {
-			LOG_DBG("Gateway object create request %s: idx: %d inst: %d name: %s",
-				addr_str, idx, lcz_lwm2m_gw_obj_get_instance(idx), get_name(idx));
-		}
-		if (idx == -ENOMEM) {
-			lbs.table_full = true;
-		}
-	}
+	lbs.capture_head = 0;
+	lbs.capture_used = 0;
+	k_spin_unlock(&lbs.capture_lock, key);
+}
 
-	if (idx >= MAX_INSTANCES) {
-		LOG_ERR("Invalid index");
-		return -EPERM;
+size_t lcz_lwm2m_ble_sensor_capture_size(void)
+{
+	return lbs.capture_used;
+}
+
+size_t lcz_lwm2m_ble_sensor_capture_read(size_t offset, uint8_t *buf, size_t size)
+{
+	k_spinlock_key_t key;
+	size_t len = 0;
+
+	key = k_spin_lock(&lbs.capture_lock);
+	if (offset < lbs.capture_used) {
+		len = MIN(size, lbs.capture_used - offset);
+		capture_copy_out(offset, buf, len);
 	}
+	k_spin_unlock(&lbs.capture_lock, key);
 
-	return idx;
+	return len;
 }
 
-static int ad_filter(const bt_addr_le_t *addr, LczSensorAdEvent_t *p, int8_t rssi)
+int lcz_lwm2m_ble_sensor_replay(const uint8_t *data, size_t len, uint32_t speed)
 {
-	int idx = -EPERM;
+	struct lcz_lwm2m_ble_sensor_capture_record record;
+	uint32_t prev = 0;
+	size_t offset = 0;
+	int count = 0;
 
-	do {
-		if (p == NULL) {
-			break;
-		}
+	if (data == NULL) {
+		return -EINVAL;
+	}
 
-		/* Short circuit if event type isn't supported */
-		if (ad_discard(p)) {
-			break;
-		}
+	if (replay_begin() != 0) {
+		return -EBUSY;
+	}
 
-		INCR_STAT(accepted_ads);
-		idx = get_index(addr, true);
-		if (!valid_index(idx)) {
+	while ((len - offset) >= CAPTURE_HEADER_SIZE) {
+		memcpy(&record, &data[offset], CAPTURE_HEADER_SIZE);
+		offset += CAPTURE_HEADER_SIZE;
+		if (record.len > (len - offset)) {
 			break;
 		}
-		INCR_STAT(indexed_ads);
 
-		/* Filter out duplicate events */
-		if ((p->id == lbs.table[idx].last_event_id) &&
-		    (p->recordType == lbs.table[idx].last_record_type)) {
-			break;
-		}
+		replay_delay(&prev, record.timestamp, speed);
+		replay_record(&record, &data[offset]);
+		offset += record.len;
+		count += 1;
+	}
 
-		if (IS_ENABLED(CONFIG_LCZ_LWM2M_BLE_EVENT_LOG_VERBOSE)) {
-			LOG_INF("%s idx: %d RSSI: %d id: %u",
-				lcz_sensor_event_get_string(p->recordType), idx, rssi, p->id);
-		}
+	atomic_clear(&lbs.replay_busy);
 
-		lbs.table[idx].last_event_id = p->id;
-		lbs.table[idx].last_record_type = p->recordType;
+	return (offset == len) ? count : -EINVAL;
+}
 
-#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_LED)
-		lcz_led_blink(BLE_LED, &BLE_ACTIVITY_LED_PATTERN);
+int lcz_lwm2m_ble_sensor_capture_replay(uint32_t speed)
+{
+	struct lcz_lwm2m_ble_sensor_capture_record record;
+	/* Only used while replay_busy is set */
+	static uint8_t data[CAPTURE_AD_MAX];
+	uint32_t prev = 0;
+	size_t offset = 0;
+	int count = 0;
+
+	/* The capture must not change while it is replayed */
+	if (atomic_get(&lbs.capture_active) != 0) {
+		return -EBUSY;
+	}
+
+	if (replay_begin() != 0) {
+		return -EBUSY;
+	}
+
+	while (offset < lbs.capture_used) {
+		capture_copy_out(offset, &record, CAPTURE_HEADER_SIZE);
+		capture_copy_out(offset + CAPTURE_HEADER_SIZE, data, record.len);
+		offset += CAPTURE_HEADER_SIZE + record.len;
+
+		replay_delay(&prev, record.timestamp, speed);
+		replay_record(&record, data);
+		count += 1;
+	}
+
+	atomic_clear(&lbs.replay_busy);
+
+	return count;
+}
 #endif
-		ad_process(idx, p, rssi);
 
-		/* An ad that we care about has been seen; prevent device from being removed from table */
-		if (lcz_lwm2m_gw_obj_set_lifetime(idx, LIFETIME) != 0) {
-			LOG_ERR("Unable to set lifetime");
-		}
-	} while (0);
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_REJECT_CACHE)
+void lcz_lwm2m_ble_sensor_reject_cache_clear(void)
+{
+	reject_clear();
+}
+#endif
 
-	return idx;
+void lcz_lwm2m_ble_sensor_create_min_rssi_set(int8_t rssi)
+{
+	lbs.create_min_rssi = rssi;
 }
 
-/* need to filter on if objects are enabled */
-static bool ad_discard(LczSensorAdEvent_t *p)
+int8_t lcz_lwm2m_ble_sensor_create_min_rssi_get(void)
 {
-	bool discard = true;
+	return lbs.create_min_rssi;
+}
 
-	switch (p->recordType) {
-	case SENSOR_EVENT_TEMPERATURE:
-		if (IS_ENABLED(CONFIG_LCZ_LWM2M_TEMPERATURE)) {
-			discard = false;
-		}
-		break;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SIGNAL)
+int lcz_lwm2m_ble_sensor_signal_get(int idx, struct lcz_lwm2m_ble_sensor_signal *signal)
+{
+	k_spinlock_key_t key;
+	uint32_t last;
 
-	case SENSOR_EVENT_BATTERY_GOOD:
-	case SENSOR_EVENT_BATTERY_BAD:
-		if (IS_ENABLED(CONFIG_LCZ_LWM2M_BATTERY)) {
-			discard = false;
-		}
-		break;
+	if (!valid_index(idx) || signal == NULL) {
+		return -EINVAL;
+	}
 
-	case SENSOR_EVENT_TEMPERATURE_1:
-	case SENSOR_EVENT_TEMPERATURE_2:
-	case SENSOR_EVENT_TEMPERATURE_3:
-	case SENSOR_EVENT_TEMPERATURE_4:
-		if (IS_ENABLED(CONFIG_LCZ_LWM2M_TEMPERATURE)) {
-			discard = false;
-		}
-		break;
+	key = k_spin_lock(&lbs.signal_lock);
+	signal->count = lbs.ad_count[idx];
+	signal->rssi = (int8_t)(lbs.rssi_avg[idx] / 16);
+	signal->rssi_last = lbs.rssi_last[idx];
+	signal->interval = lbs.ad_interval[idx];
+	last = lbs.ad_last[idx];
+	k_spin_unlock(&lbs.signal_lock, key);
 
-	case SENSOR_EVENT_CURRENT_1:
-	case SENSOR_EVENT_CURRENT_2:
-	case SENSOR_EVENT_CURRENT_3:
-	case SENSOR_EVENT_CURRENT_4:
-		if (IS_ENABLED(CONFIG_LCZ_LWM2M_CURRENT)) {
-			discard = false;
-		}
-		break;
+	if (signal->count == 0) {
+		return -ENOENT;
+	}
 
-	case SENSOR_EVENT_PRESSURE_1:
-	case SENSOR_EVENT_PRESSURE_2:
-		if (IS_ENABLED(CONFIG_LCZ_LWM2M_PRESSURE)) {
-			discard = false;
-		}
-		break;
+	signal->ads_per_minute =
+		(signal->interval == 0) ? 0 : (60U * MSEC_PER_SEC) / signal->interval;
+	signal->age = (k_uptime_get_32() - last) / MSEC_PER_SEC;
 
-	case SENSOR_EVENT_ULTRASONIC_1:
-		if (IS_ENABLED(CONFIG_LCZ_LWM2M_FILL_LEVEL)) {
-			discard = false;
-		}
-		break;
+	return 0;
+}
+#endif
 
-	default:
-		discard = true;
-		break;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SAMPLES)
+int lcz_lwm2m_ble_sensor_samples_take(int idx, uint8_t record_type,
+				      struct lcz_lwm2m_ble_sensor_sample *samples, size_t max)
+{
+	struct sample_ring *ring;
+	k_spinlock_key_t key;
+	size_t count = 0;
+
+	if (!valid_index(idx) || lbs.decoder[record_type] == NULL ||
+	    (samples == NULL && max > 0)) {
+		return -EINVAL;
+	}
+
+	key = k_spin_lock(&lbs.sample_lock);
+	ring = sample_ring_find(idx, record_channel(record_type));
+	if (ring != NULL) {
+		count = MIN(max, ring->count);
+		for (size_t i = 0; i < count; i++) {
+			samples[i] = ring->samples[ring->head];
+			ring->head = (ring->head + 1) % SAMPLE_RING_SIZE;
+		}
+		ring->count -= count;
 	}
+	k_spin_unlock(&lbs.sample_lock, key);
 
-	return discard;
+	return count;
 }
 
-static void ad_process(int idx, LczSensorAdEvent_t *p, int8_t rssi)
+int lcz_lwm2m_ble_sensor_samples_count(int idx, uint8_t record_type)
 {
-	uint16_t offset = 0;
-	double data = 0.0;
-	uint8_t percentage;
-	int r = -EPERM;
+	struct sample_ring *ring;
+	k_spinlock_key_t key;
+	int count = 0;
 
-	switch (p->recordType) {
-	case SENSOR_EVENT_TEMPERATURE:
-#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE)
-		data = (((double)((int16_t)p->data.u16)) / 100.0);
-		r = lcz_lwm2m_managed_temperature_set(idx, offset, data);
-#endif
-		break;
+	if (!valid_index(idx) || lbs.decoder[record_type] == NULL) {
+		return -EINVAL;
+	}
 
-	case SENSOR_EVENT_TEMPERATURE_1:
-	case SENSOR_EVENT_TEMPERATURE_2:
-	case SENSOR_EVENT_TEMPERATURE_3:
-	case SENSOR_EVENT_TEMPERATURE_4:
-#if defined(CONFIG_LCZ_LWM2M_TEMPERATURE)
-		data = (double)p->data.f;
-		offset = (p->recordType - SENSOR_EVENT_TEMPERATURE_1);
-		r = lcz_lwm2m_managed_temperature_set(idx, offset, data);
+	key = k_spin_lock(&lbs.sample_lock);
+	ring = sample_ring_find(idx, record_channel(record_type));
+	if (ring != NULL) {
+		count = ring->count;
+	}
+	k_spin_unlock(&lbs.sample_lock, key);
+
+	return count;
+}
 #endif
-		break;
 
-	case SENSOR_EVENT_BATTERY_GOOD:
-	case SENSOR_EVENT_BATTERY_BAD:
-#if defined(CONFIG_LCZ_LWM2M_BATTERY)
-		switch (lbs.table[idx].product_id) {
-		case BT510_PRODUCT_ID:
-			data = ((double)((uint32_t)p->data.u16)) / 1000.0;
-			percentage = lcz_lwm2m_battery_get_level_bt510(data);
-			break;
-		case BT6XX_PRODUCT_ID:
-			data = ((double)((uint32_t)p->data.s32)) / 1000.0;
-			percentage = lcz_lwm2m_battery_get_level_bt610(data);
-			break;
-		default:
-			data = 0;
-			percentage = 0;
-			break;
-		}
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_PRIORITY)
+int lcz_lwm2m_ble_sensor_priority_set(uint8_t record_type, bool priority)
+{
+	if (record_type == SENSOR_EVENT_RESERVED) {
+		return -EINVAL;
+	}
 
-		r = lcz_lwm2m_managed_battery_set(idx, offset, data, percentage);
-#endif
-		break;
+	atomic_set_bit_to(lbs.priority, record_type, priority);
 
-	case SENSOR_EVENT_CURRENT_1:
-	case SENSOR_EVENT_CURRENT_2:
-	case SENSOR_EVENT_CURRENT_3:
-	case SENSOR_EVENT_CURRENT_4:
-#if defined(CONFIG_LCZ_LWM2M_CURRENT)
-		data = (double)p->data.f;
-		offset = (p->recordType - SENSOR_EVENT_CURRENT_1);
-		r = lcz_lwm2m_managed_current_set(idx, offset, data);
-#endif
-		break;
+	return 0;
+}
 
-	case SENSOR_EVENT_PRESSURE_1:
-	case SENSOR_EVENT_PRESSURE_2:
-#if defined(CONFIG_LCZ_LWM2M_PRESSURE)
-		data = (double)p->data.f;
-		offset = (p->recordType - SENSOR_EVENT_PRESSURE_1);
-		r = lcz_lwm2m_managed_pressure_set(idx, offset, data);
+bool lcz_lwm2m_ble_sensor_priority_get(uint8_t record_type)
+{
+	return atomic_test_bit(lbs.priority, record_type);
+}
 #endif
-		break;
 
-	case SENSOR_EVENT_ULTRASONIC_1:
-#if defined(CONFIG_LCZ_LWM2M_FILL_LEVEL)
-		/* Convert from mm (reported) to cm (filling sensor) */
-		data = (double)p->data.f / 10.0;
-		r = lcz_lwm2m_managed_fill_level_set(idx, offset, data);
-#endif
-		break;
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_STATS)
+int lcz_lwm2m_ble_sensor_stats_snapshot(struct lcz_lwm2m_ble_sensor_stats *stats)
+{
+	k_spinlock_key_t key;
+	size_t i;
 
-	default:
-		LOG_WRN("Unhandled advertisement event");
-		break;
+	if (stats == NULL) {
+		return -EINVAL;
 	}
 
-	INCR_STAT(processed_ads);
-	if (r == 0) {
-		INCR_STAT(set_events);
-	} else {
-		INCR_STAT(set_errors);
+	key = k_spin_lock(&lbs.stats_lock);
+	stats->timestamp = k_uptime_get();
+	stats->interval = (uint32_t)(stats->timestamp - lbs.stats_timestamp);
+	for (i = 0; i < LCZ_LWM2M_BLE_SENSOR_STAT_COUNT; i++) {
+		stats->count[i] = (uint32_t)atomic_get(&lbs.stats[i]);
+		if (stats->interval == 0) {
+			stats->rate[i] = 0;
+		} else {
+			stats->rate[i] =
+				(uint32_t)(((uint64_t)(stats->count[i] - lbs.stats_prev[i]) *
+					    MSEC_PER_SEC) /
+					   stats->interval);
+		}
+		lbs.stats_prev[i] = stats->count[i];
 	}
+	lbs.stats_timestamp = stats->timestamp;
+	k_spin_unlock(&lbs.stats_lock, key);
+
+	return 0;
 }
 
-/**
- * @brief The scan response is used to determine the sensor type.
- * Which is used to determine the battery conversion.
- */
-static int rsp_handler(const bt_addr_le_t *addr, LczSensorRsp_t *p)
+void lcz_lwm2m_ble_sensor_stats_reset(void)
 {
-	int idx = -EPERM;
+	k_spinlock_key_t key;
+	size_t i;
 
-	if (p == NULL) {
-		return idx;
-	}
-
-	idx = get_index(addr, false);
-	if (idx >= 0) {
-		lbs.table[idx].product_id = p->productId;
+	key = k_spin_lock(&lbs.stats_lock);
+	for (i = 0; i < LCZ_LWM2M_BLE_SENSOR_STAT_COUNT; i++) {
+		atomic_clear(&lbs.stats[i]);
+		lbs.stats_prev[i] = 0;
 	}
-	return idx;
+	lbs.stats_timestamp = k_uptime_get();
+	k_spin_unlock(&lbs.stats_lock, key);
 }
+#endif
 
-static void name_handler(int idx, struct net_buf_simple *ad)
+#if defined(CONFIG_LCZ_LWM2M_BATTERY)
+int lcz_lwm2m_ble_sensor_battery_register(struct lcz_lwm2m_ble_sensor_battery_curve *curve)
 {
-	AdHandle_t handle;
-	int r;
+	k_spinlock_key_t key;
 
-	if (!valid_index(idx)) {
-		return;
+	if (curve == NULL || curve->level == NULL || curve->count == 0 || curve->step_mv == 0) {
+		return -EINVAL;
 	}
 
-	handle = AdFind_Name(ad->data, ad->len);
-	if (handle.pPayload == NULL) {
-		return;
-	}
+	key = k_spin_lock(&lbs.battery_lock);
+	sys_slist_find_and_remove(&lbs.battery_curves, &curve->node);
+	sys_slist_prepend(&lbs.battery_curves, &curve->node);
+	k_spin_unlock(&lbs.battery_lock, key);
 
-	/* If the LwM2M connection has been proxied or named already, then don't try to set name. */
-	if (lcz_lwm2m_gw_obj_inst_created(idx)) {
-		return;
-	}
+	return 0;
+}
+#endif
 
-	r = lcz_lwm2m_gw_obj_set_endpoint_name(idx, handle.pPayload, handle.size);
-	if (r == 0) {
-		INCR_STAT(name_updates);
+const char *lcz_lwm2m_ble_sensor_stat_name(enum lcz_lwm2m_ble_sensor_stat stat)
+{
+	if (stat < ARRAY_SIZE(stat_names)) {
+		return stat_names[stat];
 	}
-	LOG_DBG("Set endpoint name in database[%d]: %d", idx, r);
+
+	return "?";
 }
 
-static int gw_obj_removed(int idx, void *context)
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_TIMING)
+int lcz_lwm2m_ble_sensor_timing_get(enum lcz_lwm2m_ble_sensor_stage stage,
+				    struct lcz_lwm2m_ble_sensor_timing *timing)
 {
-	ARG_UNUSED(context);
+	k_spinlock_key_t key;
 
-	if (valid_index(idx)) {
-		lbs.table_full = false;
-		lbs.table[idx].product_id = INVALID_PRODUCT_ID;
+	if (stage >= LCZ_LWM2M_BLE_SENSOR_STAGE_COUNT || timing == NULL) {
+		return -EINVAL;
 	}
 
+	key = k_spin_lock(&lbs.timing_lock);
+	memcpy(timing, &lbs.timing[stage], sizeof(*timing));
+	k_spin_unlock(&lbs.timing_lock, key);
+
 	return 0;
 }
 
-#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_LOG_LEVEL_DBG)
-static const char *get_name(int idx)
+void lcz_lwm2m_ble_sensor_timing_reset(void)
 {
-	static char name[SENSOR_NAME_MAX_SIZE];
-	int r;
+	k_spinlock_key_t key;
 
-	memset(name, 0, sizeof(name));
-	r = lcz_lwm2m_gw_obj_get_endpoint_name(idx, name, SENSOR_NAME_MAX_STR_LEN);
-	if (r < 0) {
-		return "?";
-	} else {
-		return name;
+	key = k_spin_lock(&lbs.timing_lock);
+	memset(lbs.timing, 0, sizeof(lbs.timing));
+	k_spin_unlock(&lbs.timing_lock, key);
+}
+#endif
+
+const char *lcz_lwm2m_ble_sensor_stage_name(enum lcz_lwm2m_ble_sensor_stage stage)
+{
+	if (stage < ARRAY_SIZE(stage_names)) {
+		return stage_names[stage];
 	}
+
+	return "?";
 }
-#endif
\ No newline at end of file
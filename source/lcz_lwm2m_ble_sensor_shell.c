@@ -0,0 +1,289 @@
+/**
+ * @file lcz_lwm2m_ble_sensor_shell.c
+ * @brief Shell commands for the LwM2M BLE sensor module
+ *
+ * Copyright (c) 2022 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**************************************************************************************************/
+/* Includes                                                                                       */
+/**************************************************************************************************/
+#include <zephyr.h>
+#include <shell/shell.h>
+#include <stdlib.h>
+
+#include "lcz_lwm2m_ble_sensor.h"
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SIGNAL)
+#include <bluetooth/bluetooth.h>
+#include "lcz_lwm2m_gateway_obj.h"
+#endif
+
+/**************************************************************************************************/
+/* Local Function Definitions                                                                     */
+/**************************************************************************************************/
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_STATS)
+static int stats_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+	struct lcz_lwm2m_ble_sensor_stats stats;
+	size_t i;
+	int r;
+
+	r = lcz_lwm2m_ble_sensor_stats_snapshot(&stats);
+	if (r < 0) {
+		shell_error(shell, "Unable to read stats: %d", r);
+		return r;
+	}
+
+	shell_print(shell, "%-16s %10s %8s", "stat", "count", "per sec");
+	for (i = 0; i < LCZ_LWM2M_BLE_SENSOR_STAT_COUNT; i++) {
+		shell_print(shell, "%-16s %10u %8u", lcz_lwm2m_ble_sensor_stat_name(i),
+			    stats.count[i], stats.rate[i]);
+	}
+
+	if (stats.count[LCZ_LWM2M_BLE_SENSOR_STAT_DEDUP_LOOKUPS] != 0) {
+		shell_print(shell, "dedup hit rate   %u%%",
+			    (stats.count[LCZ_LWM2M_BLE_SENSOR_STAT_DEDUP_HITS] * 100U) /
+				    stats.count[LCZ_LWM2M_BLE_SENSOR_STAT_DEDUP_LOOKUPS]);
+	}
+	shell_print(shell, "interval         %u ms", stats.interval);
+
+	return 0;
+}
+
+static int stats_reset_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	lcz_lwm2m_ble_sensor_stats_reset();
+	shell_print(shell, "Stats cleared");
+
+	return 0;
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_TIMING)
+static int timing_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+	struct lcz_lwm2m_ble_sensor_timing t;
+	uint32_t avg;
+	size_t stage;
+	size_t i;
+
+	shell_print(shell, "cycles/sec: %u", sys_clock_hw_cycles_per_sec());
+	shell_print(shell, "%-12s %10s %10s %10s %10s %10s", "stage", "count", "min", "avg", "max",
+		    "avg us");
+	for (stage = 0; stage < LCZ_LWM2M_BLE_SENSOR_STAGE_COUNT; stage++) {
+		if (lcz_lwm2m_ble_sensor_timing_get(stage, &t) < 0 || t.count == 0) {
+			continue;
+		}
+
+		avg = (uint32_t)(t.total / t.count);
+		shell_print(shell, "%-12s %10u %10u %10u %10u %10u",
+			    lcz_lwm2m_ble_sensor_stage_name(stage), t.count, t.min, avg, t.max,
+			    k_cyc_to_us_floor32(avg));
+	}
+
+	shell_print(shell, "log2 histogram (cycles)");
+	for (stage = 0; stage < LCZ_LWM2M_BLE_SENSOR_STAGE_COUNT; stage++) {
+		if (lcz_lwm2m_ble_sensor_timing_get(stage, &t) < 0 || t.count == 0) {
+			continue;
+		}
+
+		shell_print(shell, "%s", lcz_lwm2m_ble_sensor_stage_name(stage));
+		for (i = 0; i < LCZ_LWM2M_BLE_SENSOR_TIMING_BUCKETS; i++) {
+			if (t.histogram[i] != 0) {
+				shell_print(shell, "  >= %8u: %u", (i == 0) ? 0U : (uint32_t)BIT(i),
+					    t.histogram[i]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int timing_reset_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	lcz_lwm2m_ble_sensor_timing_reset();
+	shell_print(shell, "Timing cleared");
+
+	return 0;
+}
+#endif
+
+static int min_rssi_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+	if (argc > 1) {
+		lcz_lwm2m_ble_sensor_create_min_rssi_set((int8_t)strtol(argv[1], NULL, 0));
+	}
+	shell_print(shell, "Minimum RSSI of a new device: %d dBm",
+		    lcz_lwm2m_ble_sensor_create_min_rssi_get());
+
+	return 0;
+}
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SIGNAL)
+static int devices_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+	struct lcz_lwm2m_ble_sensor_signal signal;
+	char addr_str[BT_ADDR_LE_STR_LEN];
+	const bt_addr_le_t *addr;
+	int idx;
+
+	shell_print(shell, "%-4s %-30s %5s %5s %8s %8s %8s", "idx", "address", "rssi", "last",
+		    "ads/min", "count", "age (s)");
+	for (idx = 0; idx < CONFIG_LCZ_LWM2M_GATEWAY_MAX_INSTANCES; idx++) {
+		if (lcz_lwm2m_ble_sensor_signal_get(idx, &signal) < 0) {
+			continue;
+		}
+		addr = lcz_lwm2m_gw_obj_get_address(idx);
+		if (addr == NULL) {
+			continue;
+		}
+		bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
+		shell_print(shell, "%-4d %-30s %5d %5d %8u %8u %8u", idx, addr_str, signal.rssi,
+			    signal.rssi_last, signal.ads_per_minute, signal.count, signal.age);
+	}
+
+	return 0;
+}
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE)
+static int capture_start_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	lcz_lwm2m_ble_sensor_capture_start();
+	shell_print(shell, "Capture started");
+
+	return 0;
+}
+
+static int capture_stop_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	lcz_lwm2m_ble_sensor_capture_stop();
+	shell_print(shell, "Capture stopped: %zu bytes", lcz_lwm2m_ble_sensor_capture_size());
+
+	return 0;
+}
+
+static int capture_clear_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	lcz_lwm2m_ble_sensor_capture_clear();
+	shell_print(shell, "Capture cleared");
+
+	return 0;
+}
+
+static int capture_dump_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+	uint8_t buf[64];
+	size_t offset = 0;
+	size_t len;
+
+	shell_print(shell, "size: %zu", lcz_lwm2m_ble_sensor_capture_size());
+	while ((len = lcz_lwm2m_ble_sensor_capture_read(offset, buf, sizeof(buf))) > 0) {
+		shell_hexdump(shell, buf, len);
+		offset += len;
+	}
+
+	return 0;
+}
+
+static int capture_replay_cmd(const struct shell *shell, size_t argc, char **argv)
+{
+	uint32_t speed = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1;
+	int r;
+
+	r = lcz_lwm2m_ble_sensor_capture_replay(speed);
+	if (r < 0) {
+		shell_error(shell, "Unable to replay capture: %d", r);
+		return r;
+	}
+
+	shell_print(shell, "Replayed %d records", r);
+
+	return 0;
+}
+#endif
+
+/**************************************************************************************************/
+/* SYS INIT                                                                                       */
+/**************************************************************************************************/
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_STATS)
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_stats,
+			       SHELL_CMD(reset, NULL, "Clear statistics", stats_reset_cmd),
+			       SHELL_SUBCMD_SET_END);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_TIMING)
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_timing,
+			       SHELL_CMD(reset, NULL, "Clear timing", timing_reset_cmd),
+			       SHELL_SUBCMD_SET_END);
+#endif
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE)
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_capture,
+			       SHELL_CMD(start, NULL, "Start capturing advertisements",
+					 capture_start_cmd),
+			       SHELL_CMD(stop, NULL, "Stop capturing advertisements",
+					 capture_stop_cmd),
+			       SHELL_CMD(clear, NULL, "Discard the capture", capture_clear_cmd),
+			       SHELL_CMD(dump, NULL, "Hex dump of the capture records",
+					 capture_dump_cmd),
+			       SHELL_CMD_ARG(replay, NULL,
+					     "Process the capture again\n"
+					     "[speed] 0: no delay, 1: original rate (default), "
+					     "n: n times faster",
+					     capture_replay_cmd, 1, 1),
+			       SHELL_SUBCMD_SET_END);
+#endif
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_ble_sensor,
+			       SHELL_CMD_ARG(min_rssi, NULL,
+					     "Show or set the minimum RSSI of an ad that adds a "
+					     "device\n"
+					     "[dBm]",
+					     min_rssi_cmd, 1, 1),
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_SIGNAL)
+			       SHELL_CMD(devices, NULL, "Show the reception of each device",
+					 devices_cmd),
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_STATS)
+			       SHELL_CMD(stats, &sub_stats,
+					 "Show counters and rates since the previous snapshot",
+					 stats_cmd),
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_TIMING)
+			       SHELL_CMD(timing, &sub_timing,
+					 "Show the duration of each processing stage", timing_cmd),
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_CAPTURE)
+			       SHELL_CMD(capture, &sub_capture, "Capture and replay advertisements",
+					 NULL),
+#endif
+			       SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(ble_sensor, &sub_ble_sensor, "LwM2M BLE sensor commands", NULL);
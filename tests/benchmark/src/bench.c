@@ -0,0 +1,391 @@
+/**
+ * @file bench.c
+ * @brief Feed synthetic advertisements through the LwM2M BLE sensor module.
+ * The gateway and LwM2M object calls are replaced by stubs that count calls.
+ *
+ * Copyright (c) 2022 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**************************************************************************************************/
+/* Includes                                                                                       */
+/**************************************************************************************************/
+#include <zephyr.h>
+#include <bluetooth/bluetooth.h>
+
+#include "lcz_sensor_event.h"
+#include "lcz_sensor_adv_format.h"
+#include "lcz_lwm2m_ble_sensor.h"
+#include "bench.h"
+
+/**************************************************************************************************/
+/* Local Constant, Macro and Type Definitions                                                     */
+/**************************************************************************************************/
+#define MAX_INSTANCES CONFIG_LCZ_LWM2M_GATEWAY_MAX_INSTANCES
+#define MAX_DEVICES CONFIG_BENCHMARK_MAX_DEVICES
+
+#define BENCH_NAME_PREFIX "BENCH-"
+#define BENCH_NAME_SIZE (sizeof(BENCH_NAME_PREFIX) - 1 + 4)
+
+/* Flags, manufacturer data, and an optional complete name */
+#define BENCH_AD_SIZE (3 + 2 + sizeof(LczSensorAdCoded_t) + 2 + BENCH_NAME_SIZE)
+
+enum bench_count {
+	BENCH_LOOKUPS,
+	BENCH_CREATES,
+	BENCH_LIFETIME_SETS,
+	BENCH_NAME_SETS,
+	BENCH_TEMPERATURE_SETS,
+	BENCH_CURRENT_SETS,
+	BENCH_PRESSURE_SETS,
+	BENCH_BATTERY_SETS,
+	BENCH_FILL_LEVEL_SETS,
+	BENCH_COUNT
+};
+
+/**************************************************************************************************/
+/* Local Data Definitions                                                                         */
+/**************************************************************************************************/
+static struct {
+	atomic_t busy;
+	atomic_t count[BENCH_COUNT];
+	/* Stand-in for the gateway object table */
+	struct k_spinlock lock;
+	bt_addr_le_t addr[MAX_INSTANCES];
+	size_t used;
+	/* Event id of each synthetic sensor */
+	uint16_t id[MAX_DEVICES];
+	uint32_t rand;
+} bench;
+
+/**************************************************************************************************/
+/* Local Function Prototypes                                                                      */
+/**************************************************************************************************/
+static uint32_t bench_rand(void);
+static bool bench_chance(uint8_t percent);
+static void bench_addr(uint16_t device, bt_addr_le_t *addr);
+static void bench_event(LczSensorAdEvent_t *ev, uint16_t protocol_id, const bt_addr_le_t *addr,
+			uint16_t id);
+static void bench_rsp(LczSensorRsp_t *rsp);
+static size_t bench_ad(uint8_t *data, uint16_t device, uint16_t id, uint8_t *type,
+		       const struct bench_config *config);
+static size_t ad_append(uint8_t *data, uint8_t ad_type, const void *payload, size_t len);
+
+/**************************************************************************************************/
+/* Global Function Definitions                                                                    */
+/**************************************************************************************************/
+int bench_run(const struct bench_config *config, struct bench_result *result)
+{
+	uint8_t data[BENCH_AD_SIZE];
+	struct net_buf_simple ad;
+	k_spinlock_key_t key;
+	bt_addr_le_t addr;
+	uint16_t device;
+	uint8_t type;
+	size_t len;
+	int64_t start;
+	uint64_t us;
+	uint32_t i;
+
+	if (config == NULL || result == NULL || config->devices == 0 ||
+	    config->devices > MAX_DEVICES || config->duplicate_percent > 100 ||
+	    config->coded_percent > 100 || config->rsp_percent > 100) {
+		return -EINVAL;
+	}
+
+	if (atomic_set(&bench.busy, 1)) {
+		return -EBUSY;
+	}
+
+	/* Each run starts with an empty table, so the results only depend on the seed */
+	lcz_lwm2m_ble_sensor_bench_reset();
+	key = k_spin_lock(&bench.lock);
+	bench.used = 0;
+	k_spin_unlock(&bench.lock, key);
+
+	for (i = 0; i < BENCH_COUNT; i++) {
+		atomic_clear(&bench.count[i]);
+	}
+	memset(bench.id, 0, sizeof(bench.id));
+	bench.rand = (config->seed == 0) ? 1 : config->seed;
+
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_STATS)
+	lcz_lwm2m_ble_sensor_stats_reset();
+#endif
+#if defined(CONFIG_LCZ_LWM2M_BLE_SENSOR_TIMING)
+	lcz_lwm2m_ble_sensor_timing_reset();
+#endif
+
+	start = k_uptime_ticks();
+	for (i = 0; i < config->ads; i++) {
+		device = bench_rand() % config->devices;
+		/* The first event of a sensor can't be a duplicate */
+		if (bench.id[device] == 0 || !bench_chance(config->duplicate_percent)) {
+			bench.id[device] += 1;
+		}
+
+		bench_addr(device, &addr);
+		len = bench_ad(data, device, bench.id[device], &type, config);
+		net_buf_simple_init_with_data(&ad, data, len);
+		lcz_lwm2m_ble_sensor_ad_inject(&addr, -60 - (int8_t)(device % 30), type, &ad);
+	}
+	us = k_ticks_to_us_floor64(k_uptime_ticks() - start);
+
+	memset(result, 0, sizeof(*result));
+	result->ads = config->ads;
+	result->elapsed_us = (uint32_t)MIN(us, UINT32_MAX);
+	result->ads_per_sec = (us == 0) ? 0 : (uint32_t)((config->ads * 1000000ULL) / us);
+	result->lookups = atomic_get(&bench.count[BENCH_LOOKUPS]);
+	result->creates = atomic_get(&bench.count[BENCH_CREATES]);
+	result->lifetime_sets = atomic_get(&bench.count[BENCH_LIFETIME_SETS]);
+	result->name_sets = atomic_get(&bench.count[BENCH_NAME_SETS]);
+	result->temperature_sets = atomic_get(&bench.count[BENCH_TEMPERATURE_SETS]);
+	result->current_sets = atomic_get(&bench.count[BENCH_CURRENT_SETS]);
+	result->pressure_sets = atomic_get(&bench.count[BENCH_PRESSURE_SETS]);
+	result->battery_sets = atomic_get(&bench.count[BENCH_BATTERY_SETS]);
+	result->fill_level_sets = atomic_get(&bench.count[BENCH_FILL_LEVEL_SETS]);
+
+	atomic_clear(&bench.busy);
+
+	return 0;
+}
+
+/* The gateway table is a linear search, like the gateway object module */
+int __wrap_lcz_lwm2m_gw_obj_lookup_ble(const bt_addr_le_t *addr)
+{
+	k_spinlock_key_t key;
+	int idx = -ENOENT;
+	size_t i;
+
+	atomic_inc(&bench.count[BENCH_LOOKUPS]);
+
+	key = k_spin_lock(&bench.lock);
+	for (i = 0; i < bench.used; i++) {
+		if (bt_addr_le_cmp(&bench.addr[i], addr) == 0) {
+			idx = i;
+			break;
+		}
+	}
+	k_spin_unlock(&bench.lock, key);
+
+	return idx;
+}
+
+int __wrap_lcz_lwm2m_gw_obj_create(const bt_addr_le_t *addr)
+{
+	k_spinlock_key_t key;
+	int idx = -ENOMEM;
+
+	atomic_inc(&bench.count[BENCH_CREATES]);
+
+	key = k_spin_lock(&bench.lock);
+	if (bench.used < MAX_INSTANCES) {
+		bt_addr_le_copy(&bench.addr[bench.used], addr);
+		idx = bench.used++;
+	}
+	k_spin_unlock(&bench.lock, key);
+
+	return idx;
+}
+
+int __wrap_lcz_lwm2m_gw_obj_get_instance(int idx)
+{
+	return idx;
+}
+
+bool __wrap_lcz_lwm2m_gw_obj_inst_created(int idx)
+{
+	ARG_UNUSED(idx);
+
+	return false;
+}
+
+int __wrap_lcz_lwm2m_gw_obj_set_endpoint_name(int idx, uint8_t *name, int len)
+{
+	ARG_UNUSED(idx);
+	ARG_UNUSED(name);
+	ARG_UNUSED(len);
+
+	atomic_inc(&bench.count[BENCH_NAME_SETS]);
+
+	return 0;
+}
+
+int __wrap_lcz_lwm2m_gw_obj_get_endpoint_name(int idx, char *name, int len)
+{
+	ARG_UNUSED(idx);
+
+	strncpy(name, BENCH_NAME_PREFIX, len);
+
+	return 0;
+}
+
+int __wrap_lcz_lwm2m_gw_obj_set_lifetime(int idx, uint16_t lifetime)
+{
+	ARG_UNUSED(idx);
+	ARG_UNUSED(lifetime);
+
+	atomic_inc(&bench.count[BENCH_LIFETIME_SETS]);
+
+	return 0;
+}
+
+int __wrap_lcz_lwm2m_managed_temperature_set(int idx, uint16_t offset, double value)
+{
+	ARG_UNUSED(idx);
+	ARG_UNUSED(offset);
+	ARG_UNUSED(value);
+
+	atomic_inc(&bench.count[BENCH_TEMPERATURE_SETS]);
+
+	return 0;
+}
+
+int __wrap_lcz_lwm2m_managed_current_set(int idx, uint16_t offset, double value)
+{
+	ARG_UNUSED(idx);
+	ARG_UNUSED(offset);
+	ARG_UNUSED(value);
+
+	atomic_inc(&bench.count[BENCH_CURRENT_SETS]);
+
+	return 0;
+}
+
+int __wrap_lcz_lwm2m_managed_pressure_set(int idx, uint16_t offset, double value)
+{
+	ARG_UNUSED(idx);
+	ARG_UNUSED(offset);
+	ARG_UNUSED(value);
+
+	atomic_inc(&bench.count[BENCH_PRESSURE_SETS]);
+
+	return 0;
+}
+
+int __wrap_lcz_lwm2m_managed_battery_set(int idx, uint16_t offset, double voltage, uint8_t level)
+{
+	ARG_UNUSED(idx);
+	ARG_UNUSED(offset);
+	ARG_UNUSED(voltage);
+	ARG_UNUSED(level);
+
+	atomic_inc(&bench.count[BENCH_BATTERY_SETS]);
+
+	return 0;
+}
+
+int __wrap_lcz_lwm2m_managed_fill_level_set(int idx, uint16_t offset, double value)
+{
+	ARG_UNUSED(idx);
+	ARG_UNUSED(offset);
+	ARG_UNUSED(value);
+
+	atomic_inc(&bench.count[BENCH_FILL_LEVEL_SETS]);
+
+	return 0;
+}
+
+/**************************************************************************************************/
+/* Local Function Definitions                                                                     */
+/**************************************************************************************************/
+/* xorshift32; repeatable for a seed */
+static uint32_t bench_rand(void)
+{
+	bench.rand ^= bench.rand << 13;
+	bench.rand ^= bench.rand >> 17;
+	bench.rand ^= bench.rand << 5;
+
+	return bench.rand;
+}
+
+static bool bench_chance(uint8_t percent)
+{
+	return (bench_rand() % 100) < percent;
+}
+
+/* Random static address derived from the device number */
+static void bench_addr(uint16_t device, bt_addr_le_t *addr)
+{
+	addr->type = BT_ADDR_LE_RANDOM;
+	addr->a.val[0] = (uint8_t)device;
+	addr->a.val[1] = (uint8_t)(device >> 8);
+	addr->a.val[2] = 0x42;
+	addr->a.val[3] = 0x4e;
+	addr->a.val[4] = 0x45;
+	addr->a.val[5] = 0xc0;
+}
+
+/* Alternate between temperature and battery events */
+static void bench_event(LczSensorAdEvent_t *ev, uint16_t protocol_id, const bt_addr_le_t *addr,
+			uint16_t id)
+{
+	memset(ev, 0, sizeof(*ev));
+	ev->companyId = LAIRD_CONNECTIVITY_MANUFACTURER_SPECIFIC_COMPANY_ID1;
+	ev->protocolId = protocol_id;
+	memcpy(&ev->addr, &addr->a, sizeof(ev->addr));
+	ev->id = id;
+	ev->epoch = id;
+	if (id & 1) {
+		ev->recordType = SENSOR_EVENT_TEMPERATURE;
+		ev->data.u16 = 2000 + (id % 16) * 25;
+	} else {
+		ev->recordType = SENSOR_EVENT_BATTERY_GOOD;
+		ev->data.u16 = 3000 - (id % 16);
+	}
+}
+
+static void bench_rsp(LczSensorRsp_t *rsp)
+{
+	memset(rsp, 0, sizeof(*rsp));
+	rsp->productId = BT510_PRODUCT_ID;
+}
+
+static size_t bench_ad(uint8_t *data, uint16_t device, uint16_t id, uint8_t *type,
+		       const struct bench_config *config)
+{
+	static const uint8_t flags = BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR;
+	LczSensorRspWithHeader_t rsp;
+	LczSensorAdCoded_t coded;
+	LczSensorAdEvent_t ev;
+	char name[BENCH_NAME_SIZE + 1];
+	bt_addr_le_t addr;
+	size_t len = 0;
+
+	bench_addr(device, &addr);
+	snprintk(name, sizeof(name), BENCH_NAME_PREFIX "%04x", device);
+
+	/* Scan responses don't contain flags */
+	if (bench_chance(config->coded_percent)) {
+		*type = BT_GAP_ADV_TYPE_EXT_ADV;
+		bench_event(&coded.ad, BTXXX_CODED_PHY_AD_PROTOCOL_ID, &addr, id);
+		bench_rsp(&coded.rsp);
+		len += ad_append(&data[len], BT_DATA_FLAGS, &flags, sizeof(flags));
+		len += ad_append(&data[len], BT_DATA_MANUFACTURER_DATA, &coded, sizeof(coded));
+		len += ad_append(&data[len], BT_DATA_NAME_COMPLETE, name, BENCH_NAME_SIZE);
+	} else if (bench_chance(config->rsp_percent)) {
+		*type = BT_GAP_ADV_TYPE_SCAN_RSP;
+		rsp.companyId = LAIRD_CONNECTIVITY_MANUFACTURER_SPECIFIC_COMPANY_ID1;
+		rsp.protocolId = BTXXX_1M_PHY_RSP_PROTOCOL_ID;
+		bench_rsp(&rsp.rsp);
+		len += ad_append(&data[len], BT_DATA_MANUFACTURER_DATA, &rsp, sizeof(rsp));
+		len += ad_append(&data[len], BT_DATA_NAME_COMPLETE, name, BENCH_NAME_SIZE);
+	} else {
+		*type = BT_GAP_ADV_TYPE_ADV_IND;
+		bench_event(&ev, BTXXX_1M_PHY_AD_PROTOCOL_ID, &addr, id);
+		len += ad_append(&data[len], BT_DATA_FLAGS, &flags, sizeof(flags));
+		len += ad_append(&data[len], BT_DATA_MANUFACTURER_DATA, &ev, sizeof(ev));
+	}
+
+	return len;
+}
+
+static size_t ad_append(uint8_t *data, uint8_t ad_type, const void *payload, size_t len)
+{
+	data[0] = len + 1;
+	data[1] = ad_type;
+	memcpy(&data[2], payload, len);
+
+	return len + 2;
+}
@@ -0,0 +1,94 @@
+/**
+ * @file bench.h
+ * @brief Feed synthetic advertisements through the LwM2M BLE sensor module.
+ * The gateway and LwM2M object calls are replaced by counting stubs with the linker's
+ * --wrap option.
+ *
+ * Copyright (c) 2022 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+/**************************************************************************************************/
+/* Includes                                                                                       */
+/**************************************************************************************************/
+#include <zephyr.h>
+#include <bluetooth/addr.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**************************************************************************************************/
+/* Global Constants, Macros and Type Definitions                                                  */
+/**************************************************************************************************/
+struct bench_config {
+	/* Number of advertisements to process */
+	uint32_t ads;
+	/* Number of distinct sensor addresses */
+	uint16_t devices;
+	/* Percentage of ads that repeat the previous event of the sensor */
+	uint8_t duplicate_percent;
+	/* Percentage of ads that are coded PHY; the remainder are 1M */
+	uint8_t coded_percent;
+	/* Percentage of 1M ads that are scan responses */
+	uint8_t rsp_percent;
+	/* The same seed generates the same ads */
+	uint32_t seed;
+};
+
+struct bench_result {
+	uint32_t ads;
+	uint32_t elapsed_us;
+	uint32_t ads_per_sec;
+	/* Calls of the stubbed gateway and LwM2M object functions */
+	uint32_t lookups;
+	uint32_t creates;
+	uint32_t lifetime_sets;
+	uint32_t name_sets;
+	uint32_t temperature_sets;
+	uint32_t current_sets;
+	uint32_t pressure_sets;
+	uint32_t battery_sets;
+	uint32_t fill_level_sets;
+};
+
+/**************************************************************************************************/
+/* Global Function Prototypes                                                                     */
+/**************************************************************************************************/
+/**
+ * @brief Process synthetic advertisements and measure the throughput.
+ *
+ * @note Each run starts with no known devices. Statistics and timing are cleared before the
+ * ads are processed, so the per-stage durations are for this run.
+ * With deferred processing, the work queue may still be busy when this returns.
+ *
+ * @param config mix of advertisements
+ * @param result destination
+ * @return int 0 on success, else negative errno
+ */
+int bench_run(const struct bench_config *config, struct bench_result *result);
+
+/* The linker redirects the module's gateway and LwM2M object calls to these stubs */
+int __wrap_lcz_lwm2m_gw_obj_lookup_ble(const bt_addr_le_t *addr);
+int __wrap_lcz_lwm2m_gw_obj_create(const bt_addr_le_t *addr);
+int __wrap_lcz_lwm2m_gw_obj_get_instance(int idx);
+bool __wrap_lcz_lwm2m_gw_obj_inst_created(int idx);
+int __wrap_lcz_lwm2m_gw_obj_set_endpoint_name(int idx, uint8_t *name, int len);
+int __wrap_lcz_lwm2m_gw_obj_get_endpoint_name(int idx, char *name, int len);
+int __wrap_lcz_lwm2m_gw_obj_set_lifetime(int idx, uint16_t lifetime);
+
+int __wrap_lcz_lwm2m_managed_temperature_set(int idx, uint16_t offset, double value);
+int __wrap_lcz_lwm2m_managed_current_set(int idx, uint16_t offset, double value);
+int __wrap_lcz_lwm2m_managed_pressure_set(int idx, uint16_t offset, double value);
+int __wrap_lcz_lwm2m_managed_battery_set(int idx, uint16_t offset, double voltage, uint8_t level);
+int __wrap_lcz_lwm2m_managed_fill_level_set(int idx, uint16_t offset, double value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BENCH_H__ */
@@ -0,0 +1,121 @@
+/**
+ * @file main.c
+ * @brief Measure the advertisement throughput of the LwM2M BLE sensor module.
+ * The ads per second and the per-stage durations of each mix are printed so that
+ * runs can be compared across changes.
+ *
+ * Copyright (c) 2022 Laird Connectivity
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/**************************************************************************************************/
+/* Includes                                                                                       */
+/**************************************************************************************************/
+#include <zephyr.h>
+#include <ztest.h>
+
+#include "lcz_lwm2m_ble_sensor.h"
+#include "bench.h"
+
+/**************************************************************************************************/
+/* Local Constant, Macro and Type Definitions                                                     */
+/**************************************************************************************************/
+#define BENCH_ADS 100000
+#define BENCH_DEVICES MIN(150, CONFIG_BENCHMARK_MAX_DEVICES)
+
+/**************************************************************************************************/
+/* Local Function Prototypes                                                                      */
+/**************************************************************************************************/
+static void bench_print(const char *name, const struct bench_result *result);
+
+/**************************************************************************************************/
+/* Tests                                                                                          */
+/**************************************************************************************************/
+static void test_mix(void)
+{
+	static const struct {
+		const char *name;
+		struct bench_config config;
+	} mixes[] = {
+		{ "new events", { BENCH_ADS, BENCH_DEVICES, 0, 0, 0, 1 } },
+		{ "repeats", { BENCH_ADS, BENCH_DEVICES, 90, 0, 0, 1 } },
+		{ "coded and rsp", { BENCH_ADS, BENCH_DEVICES, 50, 30, 20, 1 } },
+	};
+	struct bench_result result;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(mixes); i++) {
+		zassert_equal(bench_run(&mixes[i].config, &result), 0, "%s", mixes[i].name);
+		bench_print(mixes[i].name, &result);
+
+		zassert_equal(result.ads, mixes[i].config.ads, NULL);
+		zassert_true(result.creates >= MIN(mixes[i].config.devices,
+						   CONFIG_LCZ_LWM2M_GATEWAY_MAX_INSTANCES),
+			     NULL);
+		/* Battery events need the product id, which is only in coded ads and responses */
+		zassert_true(result.temperature_sets > 0, NULL);
+	}
+}
+
+/* Each run starts with no known devices, so the same seed gives the same calls */
+static void test_repeatable(void)
+{
+	const struct bench_config config = { BENCH_ADS, BENCH_DEVICES, 50, 30, 20, 7 };
+	struct bench_result first;
+	struct bench_result second;
+
+	zassert_equal(bench_run(&config, &first), 0, NULL);
+	zassert_equal(bench_run(&config, &second), 0, NULL);
+
+	zassert_equal(first.lookups, second.lookups, NULL);
+	zassert_equal(first.creates, second.creates, NULL);
+	zassert_equal(first.name_sets, second.name_sets, NULL);
+	zassert_equal(first.temperature_sets, second.temperature_sets, NULL);
+	zassert_equal(first.battery_sets, second.battery_sets, NULL);
+}
+
+static void test_invalid(void)
+{
+	const struct bench_config config = { BENCH_ADS, 0, 0, 0, 0, 1 };
+	struct bench_result result;
+
+	zassert_equal(bench_run(&config, &result), -EINVAL, NULL);
+	zassert_equal(bench_run(NULL, &result), -EINVAL, NULL);
+}
+
+void test_main(void)
+{
+	ztest_test_suite(lcz_lwm2m_ble_sensor_benchmark, ztest_unit_test(test_mix),
+			 ztest_unit_test(test_repeatable), ztest_unit_test(test_invalid));
+	ztest_run_test_suite(lcz_lwm2m_ble_sensor_benchmark);
+}
+
+/**************************************************************************************************/
+/* Local Function Definitions                                                                     */
+/**************************************************************************************************/
+static void bench_print(const char *name, const struct bench_result *result)
+{
+	struct lcz_lwm2m_ble_sensor_timing t;
+	uint32_t avg;
+	size_t stage;
+
+	TC_PRINT("%s: %u ads in %u us, %u ads/s\n", name, result->ads, result->elapsed_us,
+		 result->ads_per_sec);
+	TC_PRINT("  lookups %u creates %u lifetime %u names %u\n", result->lookups,
+		 result->creates, result->lifetime_sets, result->name_sets);
+	TC_PRINT("  temperature %u current %u pressure %u battery %u fill level %u\n",
+		 result->temperature_sets, result->current_sets, result->pressure_sets,
+		 result->battery_sets, result->fill_level_sets);
+
+	for (stage = 0; stage < LCZ_LWM2M_BLE_SENSOR_STAGE_COUNT; stage++) {
+		if (lcz_lwm2m_ble_sensor_timing_get(stage, &t) < 0 || t.count == 0) {
+			continue;
+		}
+
+		avg = (uint32_t)(t.total / t.count);
+		TC_PRINT("  %-12s count %u avg %u us max %u us\n",
+			 lcz_lwm2m_ble_sensor_stage_name(stage), t.count, k_cyc_to_us_floor32(avg),
+			 k_cyc_to_us_floor32(t.max));
+	}
+}